@@ -6,6 +6,7 @@ import tale.app;
 import tale.scene;
 import vulkan_hpp;
 import tale.engine;
+import tale.vr;
 
 VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE
 
@@ -21,6 +22,21 @@ void spawn_layer(std::vector<tale::Entity>& entities, int side, float height, fl
     }
 }
 
+// TALE_VR_TEST_FRAMES=<count> renders that many frames with a scripted head, for runtimes without hardware
+tale::engine::Vr_test_options vr_test_options() {
+    const char* frames = std::getenv("TALE_VR_TEST_FRAMES");
+    if (frames == nullptr) {
+        return {};
+    }
+    size_t frame_limit = 0u;
+    const std::string_view value(frames);
+    if (std::from_chars(value.data(), value.data() + value.size(), frame_limit).ec != std::errc{} || frame_limit == 0u) {
+        throw std::runtime_error("TALE_VR_TEST_FRAMES should be a positive frame count.");
+    }
+    spdlog::info("VR test mode: {} frames with a scripted head.", frame_limit);
+    return {.scripted_head = tale::vr::Scripted_head{}, .frame_limit = frame_limit};
+}
+
 class Demo_app : public tale::App {
 public:
     Demo_app() {
@@ -30,10 +46,20 @@ public:
         const auto floor_id =
             scene.add_model("floor", tale::Collision_shape::Plane, {glm::vec3(-50.0, -50.0, -1.0) - inflate, glm::vec3(50.0, 50.0, 0.0) + inflate});
 
+        // The tiles only fill a thin slab of the floor bounding box
+        scene.models[floor_id].bricks = tale::Brick_decomposition{
+            .size = 1.0f, .margin = 0.2f, .distance = [](const glm::vec3& position) { return std::max(position.z, -1.0f - position.z); }
+        };
+        scene.models[floor_id].visibility.casts_shadow = false; // The lights are above it
+        // The far spheres sample a baked field instead of evaluating their map
+        scene.models[sphere_id].baked_distance_field = tale::Baked_distance_field{.resolution = 64u, .lod_distance = 12.0f};
+
         scene.center_play_area = {-20.0f, 0.0f, 0.0f};
         scene.cameras[0].pose.position = scene.center_play_area + glm::vec3(0.0f, 0.0f, 3.0f);
 
-        scene.entities.push_back(tale::Entity{.global_transform = {.position = {0.0f, 0.0f, 0.0f}, .scale = 1.0f}, .model_index = floor_id});
+        scene.entities.push_back(tale::Entity{
+            .global_transform = {.position = {0.0f, 0.0f, 0.0f}, .scale = 1.0f}, .model_index = floor_id, .mobility = tale::Mobility::Static
+        });
         spawn_layer(scene.entities, 5, 1.5f, 1.0f, sphere_id);
         spawn_layer(scene.entities, 3, 4.0f, 1.5f, cube_id);
         spawn_layer(scene.entities, 4, 5.5f, 1.5f, sphere_id);
@@ -48,7 +74,7 @@ public:
         scene.lights.push_back(tale::Light{.position = {-10.0f, -20.0f, 1.0f}, .color = {0.1f, 0.1f, 0.1f}});
 
         // systems.push_back(std::make_unique<tale::engine::Monitor_render_system>(scene, std::filesystem::path(SHADER_SOURCE)));
-        systems.push_back(std::make_unique<tale::engine::Vr_system>(scene, std::filesystem::path(SHADER_SOURCE)));
+        systems.push_back(std::make_unique<tale::engine::Vr_system>(scene, std::filesystem::path(SHADER_SOURCE), vr_test_options()));
 
         systems.push_back(std::make_unique<tale::engine::Physics_system>(scene));
     }
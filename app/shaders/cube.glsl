@@ -1,4 +1,5 @@
 #define ADVANCE_RATIO 1.0
+#define RELAXATION_FACTOR 1.6
 #define BLUE_ID 1
 
 float sd_box(in vec3 position, in vec3 half_sides)
@@ -12,3 +13,19 @@ Hit map(in vec3 position)
     float distance = sd_box(position, vec3(0.45));
     return Hit(distance - 0.05, BLUE_ID);
 }
+
+#define HAS_MAP_GRADIENT
+vec3 map_gradient(in vec3 position)
+{
+    const vec3 q = abs(position) - vec3(0.45);
+    if (any(greaterThan(q, vec3(0.0))))
+    {
+        return sign(position) * max(q, 0.0);
+    }
+    // Inside the box, towards the closest face
+    if (q.x > q.y && q.x > q.z)
+    {
+        return vec3(sign(position.x), 0.0, 0.0);
+    }
+    return q.y > q.z ? vec3(0.0, sign(position.y), 0.0) : vec3(0.0, 0.0, sign(position.z));
+}
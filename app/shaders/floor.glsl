@@ -1,4 +1,5 @@
 #define ADVANCE_RATIO 1.0
+#define RELAXATION_FACTOR 1.2
 #define WHITE_ID 2
 #define GRAY_ID 3
 
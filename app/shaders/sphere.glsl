@@ -1,4 +1,5 @@
 #define ADVANCE_RATIO 1.0
+#define RELAXATION_FACTOR 1.8
 #define RED_ID 0
 
 float sd_sphere(in vec3 position, in float radius)
@@ -9,6 +10,20 @@ float sd_sphere(in vec3 position, in float radius)
 Hit map(in vec3 position)
 {
     float d = sd_sphere(position, 0.5);
-    //d -= 0.01 * sin(30 * (position.y * position.x));
+    if (map_lod == 0u)
+    {
+        d -= 0.01 * sin(30 * (position.y * position.x));
+    }
     return Hit(d, RED_ID);
 }
+
+#define HAS_MAP_GRADIENT
+vec3 map_gradient(in vec3 position)
+{
+    vec3 gradient = normalize(position);
+    if (map_lod == 0u)
+    {
+        gradient -= 0.3 * cos(30 * (position.y * position.x)) * vec3(position.y, position.x, 0.0);
+    }
+    return gradient;
+}
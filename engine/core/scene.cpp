@@ -34,6 +34,15 @@ struct Scene_shaders {
     Shader primary_miss;
     Shader shadow_ao_miss;
     Shader shadow_ao_intersection;
+    Shader prepass_raygen;
+    Shader prepass_closest_hit;
+    Shader prepass_miss;
+    Shader foveation_reconstruct_raygen;
+    bool foveated = false; // The raygen skips rays in the periphery, foveation_reconstruct_raygen has to fill the image
+    uint32_t view_count = 1u; // Depth of the launches, one layer per eye
+    bool reprojected = false; // The raygen reuses far pixels of the previous frame, the renderer has to keep the history
+    bool writes_depth = false; // The raygen fills a depth buffer for the compositor
+    std::array<float, 2> depth_range{0.1f, 120.0f}; // Near and far planes of the depth (PREPASS_TMAX), misses are at the far plane
 };
 
 struct Model_shaders {
@@ -41,6 +50,8 @@ struct Model_shaders {
     Shader primary_closest_hit;
     Shader shadow_any_hit;
     Shader ambient_occlusion_any_hit;
+    Shader prepass_intersection;
+    Shader bake_distance_field; // Compute shader, only for the models with a baked distance field
 };
 
 export struct Material {
@@ -59,20 +70,51 @@ export struct Transform {
     glm::vec3 position{};
     glm::quat rotation{1.0, 0.0, 0.0, 0.0};
     float scale{1.0f};
+
+    bool operator==(const Transform& other) const = default;
 };
 
 export enum class Collision_shape { Sphere, Cube, Plane };
 
+// Split the bounding box in a grid of bricks, only the bricks close to the surface end up in the BLAS
+export struct Brick_decomposition {
+    float size;
+    float margin; // Distance around the surface that should stay covered, e.g. for soft shadows
+    std::function<float(const glm::vec3&)> distance; // CPU mirror of the model map, must not overestimate the distance
+};
+
+// Which rays can hit an object, e.g. a floor below everything never blocks the light
+export struct Visibility {
+    bool primary = true;
+    bool casts_shadow = true;
+    bool occludes_ambient = true;
+};
+
+// Sample the distance of the model from a 3D texture baked when loading, saves the evaluations of heavy maps for some memory
+export struct Baked_distance_field {
+    uint32_t resolution = 64u; // Voxels along each side of the bounding box
+    float lod_distance = 0.0f; // Instances closer to the camera still evaluate the exact map
+};
+
 export struct Model {
     std::string name;
     Model_shaders shaders;
     Collision_shape collision_shape;
     std::array<glm::vec3, 2> bounding_box;
+    std::optional<Brick_decomposition> bricks;
+    Visibility visibility;
+    std::optional<Baked_distance_field> baked_distance_field;
+    std::array<float, 2> lod_distances{8.0f, 32.0f}; // Camera distances where the map switches to the levels 1 and 2, see map_lod
 };
 
+// Static entities never move once added to the scene, the renderer and the physics can treat them once
+export enum class Mobility { Static, Dynamic };
+
 export struct Entity {
     Transform global_transform;
     size_t model_index;
+    Mobility mobility = Mobility::Dynamic;
+    std::optional<Visibility> visibility; // Overrides the model one
 };
 
 export class Scene {
@@ -23,6 +23,7 @@ public:
     [[nodiscard]] bool step();
     [[nodiscard]] std::vector<const char*> required_extensions() const;
     [[nodiscard]] vk::SurfaceKHR create_surface(vk::Instance instance) const;
+    [[nodiscard]] int refresh_rate() const; // Of the primary monitor, in Hz
 
     [[nodiscard]] bool was_resized() {
         bool was_resized = resized;
@@ -71,6 +72,11 @@ bool Window::step() {
     return true;
 }
 
+int Window::refresh_rate() const {
+    const GLFWvidmode* video_mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+    return video_mode && video_mode->refreshRate > 0 ? video_mode->refreshRate : 60;
+}
+
 std::vector<const char*> Window::required_extensions() const {
     uint32_t glfw_extension_count = 0;
     const char** glfw_extensions;
@@ -45,6 +45,7 @@ Monitor_render_system::Monitor_render_system(Scene& scene, std::filesystem::path
     renderer(context, scene, size_command_buffers) {
     renderer.create_per_frame_data(context, scene, init_windows_size, size_command_buffers);
     renderer.create_descriptor_sets(context.descriptor_pool, size_command_buffers);
+    renderer.display_period = std::chrono::nanoseconds(1'000'000'000 / window.refresh_rate());
 }
 
 bool Monitor_render_system::step(Scene& scene) {
@@ -56,7 +57,7 @@ bool Monitor_render_system::step(Scene& scene) {
         auto fence = command_pools.fences[command_pool_id];
         renderer.start_frame(command_buffer, command_pool_id, scene);
         renderer.trace(command_buffer, command_pool_id, scene, init_windows_size);
-        renderer.end_frame(command_buffer, fence, command_pool_id);
+        renderer.end_frame(command_buffer, fence, command_pool_id, scene);
     }
     return true;
 }
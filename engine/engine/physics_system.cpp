@@ -71,11 +71,17 @@ Physics_system::Physics_system(Scene& scene) {
             } else if (model.collision_shape == Collision_shape::Cube) {
                 shape = physics->createShape(physx::PxBoxGeometry(0.5f * scale, 0.5f * scale, 0.5f * scale), *material);
             }
-            physx::PxRigidDynamic* body = physics->createRigidDynamic(transform);
-            body->attachShape(*shape);
-            body->userData = static_cast<void*>(&entity);
-            physx::PxRigidBodyExt::updateMassAndInertia(*body, 10.0f);
-            physics_scene->addActor(*body);
+            if (entity.mobility == Mobility::Static) {
+                physx::PxRigidStatic* body = physics->createRigidStatic(transform);
+                body->attachShape(*shape);
+                physics_scene->addActor(*body);
+            } else {
+                physx::PxRigidDynamic* body = physics->createRigidDynamic(transform);
+                body->attachShape(*shape);
+                body->userData = static_cast<void*>(&entity);
+                physx::PxRigidBodyExt::updateMassAndInertia(*body, 10.0f);
+                physics_scene->addActor(*body);
+            }
             shape->release();
         }
     }
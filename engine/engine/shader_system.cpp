@@ -35,7 +35,8 @@ private:
     std::vector<Shader_file> engine_files;
     std::vector<Shader_file> models_files;
 
-    vk::ShaderModule compile(std::string_view shader_name, shaderc_shader_kind shader_kind, std::string_view model_name = {}) const;
+    vk::ShaderModule
+    compile(std::string_view shader_name, shaderc_shader_kind shader_kind, std::string_view model_name = {}, std::string_view model_map_source = {}) const;
     void read_files(const std::filesystem::path& models_shader_path);
     std::string read_file(std::filesystem::path path) const;
 };
@@ -43,14 +44,43 @@ private:
 
 module :private;
 
+constexpr bool use_enhanced_sphere_tracing = true;
+constexpr bool use_raymarch_statistics = false; // Count raymarching iterations, the renderer logs the average
+constexpr bool use_foveation = true; // Only in VR
+constexpr std::array foveation_radii{0.4f, 0.8f}; // Tangents of the angles from the eye axis where the ray rate drops to 1/2 then 1/4
+constexpr bool use_reprojection = true; // Only in VR
+constexpr bool use_reprojection_overlay = false; // Tint the reprojected pixels to check where the rays are saved
+constexpr float reprojection_min_distance = 4.0f; // Closer pixels move too much between frames, they are always traced
+constexpr float reprojection_tolerance = 0.01f; // Relative distance between the previous and the reprojected hit points
+constexpr uint32_t reprojection_refresh_period = 8u; // In frames, bounds the age of the reprojected colors
+constexpr bool use_depth_submission = true; // Only in VR, lets the compositor reproject with depth when a frame is late
+constexpr float miss_distance = 65504.0f; // Hit distance of the primary misses, the largest half float so that the histories keep it
+
 namespace tale::engine {
 
+// Map of a model sampling its baked distance field, the exact map stays available for the close instances
+std::string distance_field_map_source(const Model& model, uint32_t distance_field_index) {
+    const auto& [min, max] = model.bounding_box;
+    return std::format(
+        "#define map exact_map\n#include \"{}.glsl\"\n#undef map\n"
+        "#define DISTANCE_FIELD_INDEX {}\n#define DISTANCE_FIELD_MIN vec3({:.6f}, {:.6f}, {:.6f})\n#define DISTANCE_FIELD_MAX vec3({:.6f}, {:.6f}, {:.6f})\n"
+        "#define DISTANCE_FIELD_LOD_DISTANCE {:.6f}\n#include \"distance_field.glsl\"\n",
+        model.name, distance_field_index, min.x, min.y, min.z, max.x, max.y, max.z, model.baked_distance_field->lod_distance
+    );
+}
+
+constexpr std::string_view model_map_name = "model_map_function";
+
 class Includer : public shaderc::CompileOptions::IncluderInterface {
 public:
-    Includer(const std::vector<Shader_file>& engine_files, const std::vector<Shader_file>& models_files, std::string_view model_name):
+    Includer(
+        const std::vector<Shader_file>& engine_files, const std::vector<Shader_file>& models_files, std::string_view model_name,
+        std::string_view model_map_source
+    ):
         engine_files(engine_files),
         models_files(models_files),
-        model_filename(std::string(model_name)) {
+        model_filename(std::string(model_name)),
+        model_map_source(model_map_source) {
         if (!model_filename.empty()) {
             model_filename += ".glsl";
         }
@@ -58,7 +88,15 @@ public:
 
     shaderc_include_result*
     GetInclude(const char* requested_source, shaderc_include_type /*type*/, const char* /*requesting_source*/, size_t /*include_depth*/) override final {
-        if (!model_filename.empty() && strcmp(requested_source, "model_map_function") == 0) {
+        if (!model_filename.empty() && requested_source == model_map_name) {
+            if (!model_map_source.empty()) {
+                data_holder.content = model_map_source.data();
+                data_holder.content_length = model_map_source.size();
+                data_holder.source_name = model_map_name.data();
+                data_holder.source_name_length = model_map_name.size();
+                data_holder.user_data = nullptr;
+                return &data_holder;
+            }
             requested_source = model_filename.c_str();
         }
 
@@ -84,6 +122,7 @@ private:
     const std::vector<Shader_file>& engine_files;
     const std::vector<Shader_file>& models_files;
     std::string model_filename;
+    std::string model_map_source;
 };
 
 Shader_system::Shader_system(vulkan::Context& context, Scene& scene, const std::filesystem::path& models_shader_path, bool in_vr_mode):
@@ -96,16 +135,65 @@ Shader_system::Shader_system(vulkan::Context& context, Scene& scene, const std::
     compile_options.SetTargetEnvironment(shaderc_target_env_vulkan, shaderc_env_version_vulkan_1_3);
     compile_options.SetTargetSpirv(shaderc_spirv_version_1_6);
     compile_options.SetWarningsAsErrors();
+    if constexpr (use_enhanced_sphere_tracing) {
+        compile_options.AddMacroDefinition("ENHANCED_SPHERE_TRACING");
+    }
+    if constexpr (use_raymarch_statistics) {
+        compile_options.AddMacroDefinition("RAYMARCH_STATISTICS");
+    }
+    if (in_vr_mode) {
+        compile_options.AddMacroDefinition("STEREO"); // Both eyes side by side in the same image
+    }
+    scene.shaders.view_count = in_vr_mode ? 2u : 1u;
+    scene.shaders.foveated = use_foveation && in_vr_mode;
+    if (scene.shaders.foveated) {
+        compile_options.AddMacroDefinition("FOVEATION");
+    }
+    compile_options.AddMacroDefinition("FOVEATION_RADIUS_1", std::format("{:.6f}", foveation_radii[0]));
+    compile_options.AddMacroDefinition("FOVEATION_RADIUS_2", std::format("{:.6f}", foveation_radii[1]));
+    scene.shaders.reprojected = use_reprojection && in_vr_mode;
+    if (scene.shaders.reprojected) {
+        compile_options.AddMacroDefinition("REPROJECTION");
+        if constexpr (use_reprojection_overlay) {
+            compile_options.AddMacroDefinition("REPROJECTION_OVERLAY");
+        }
+    }
+    compile_options.AddMacroDefinition("REPROJECTION_MIN_DISTANCE", std::format("{:.6f}", reprojection_min_distance));
+    compile_options.AddMacroDefinition("REPROJECTION_TOLERANCE", std::format("{:.6f}", reprojection_tolerance));
+    compile_options.AddMacroDefinition("REPROJECTION_REFRESH_PERIOD", std::format("{}u", reprojection_refresh_period));
+    scene.shaders.writes_depth = use_depth_submission && in_vr_mode;
+    if (scene.shaders.writes_depth) {
+        compile_options.AddMacroDefinition("DEPTH_OUTPUT");
+    }
+    compile_options.AddMacroDefinition("DEPTH_NEAR", std::format("{:.6f}", scene.shaders.depth_range[0]));
+    compile_options.AddMacroDefinition("DEPTH_FAR", std::format("{:.6f}", scene.shaders.depth_range[1]));
+    compile_options.AddMacroDefinition("MISS_DISTANCE", std::format("{:.6f}", miss_distance));
+    const auto distance_field_count = std::ranges::count_if(scene.models, [](const Model& model) { return model.baked_distance_field.has_value(); });
+    if (distance_field_count > 0) {
+        compile_options.AddMacroDefinition("DISTANCE_FIELD_COUNT", std::to_string(distance_field_count));
+    }
 
-    scene.shaders.raygen.module = compile(in_vr_mode ? "raygen_vr.rgen" : "raygen_monitor.rgen", shaderc_raygen_shader);
+    scene.shaders.raygen.module = compile("raygen.rgen", shaderc_raygen_shader);
     scene.shaders.primary_miss.module = compile("primary.rmiss", shaderc_miss_shader);
     scene.shaders.shadow_ao_miss.module = compile("shadow_ao.rmiss", shaderc_miss_shader);
     scene.shaders.shadow_ao_intersection.module = compile("shadow_ao.rint", shaderc_intersection_shader);
+    scene.shaders.prepass_raygen.module = compile("prepass.rgen", shaderc_raygen_shader);
+    scene.shaders.prepass_closest_hit.module = compile("prepass.rchit", shaderc_closesthit_shader);
+    scene.shaders.prepass_miss.module = compile("prepass.rmiss", shaderc_miss_shader);
+    scene.shaders.foveation_reconstruct_raygen.module = compile("foveation_reconstruct.rgen", shaderc_raygen_shader);
+    uint32_t distance_field_index = 0u;
     for (auto& model : scene.models) {
-        model.shaders.primary_intersection.module = compile("primary.rint", shaderc_intersection_shader, model.name);
-        model.shaders.primary_closest_hit.module = compile("primary.rchit", shaderc_closesthit_shader, model.name);
-        model.shaders.shadow_any_hit.module = compile("shadow.rahit", shaderc_anyhit_shader, model.name);
-        model.shaders.ambient_occlusion_any_hit.module = compile("ambient_occlusion.rahit", shaderc_anyhit_shader, model.name);
+        std::string map_source;
+        if (model.baked_distance_field) {
+            // The bake evaluates the exact map, the ray tracing shaders sample the result
+            model.shaders.bake_distance_field.module = compile("bake_distance_field.comp", shaderc_compute_shader, model.name);
+            map_source = distance_field_map_source(model, distance_field_index++);
+        }
+        model.shaders.primary_intersection.module = compile("primary.rint", shaderc_intersection_shader, model.name, map_source);
+        model.shaders.primary_closest_hit.module = compile("primary.rchit", shaderc_closesthit_shader, model.name, map_source);
+        model.shaders.shadow_any_hit.module = compile("shadow.rahit", shaderc_anyhit_shader, model.name, map_source);
+        model.shaders.ambient_occlusion_any_hit.module = compile("ambient_occlusion.rahit", shaderc_anyhit_shader, model.name, map_source);
+        model.shaders.prepass_intersection.module = compile("prepass.rint", shaderc_intersection_shader, model.name, map_source);
     }
 }
 
@@ -116,22 +204,29 @@ void Shader_system::cleanup(Scene& scene) {
     device.destroyShaderModule(scene.shaders.primary_miss.module);
     device.destroyShaderModule(scene.shaders.shadow_ao_miss.module);
     device.destroyShaderModule(scene.shaders.shadow_ao_intersection.module);
+    device.destroyShaderModule(scene.shaders.prepass_raygen.module);
+    device.destroyShaderModule(scene.shaders.prepass_closest_hit.module);
+    device.destroyShaderModule(scene.shaders.prepass_miss.module);
+    device.destroyShaderModule(scene.shaders.foveation_reconstruct_raygen.module);
     for (auto& model : scene.models) {
         device.destroyShaderModule(model.shaders.primary_intersection.module);
         device.destroyShaderModule(model.shaders.primary_closest_hit.module);
         device.destroyShaderModule(model.shaders.shadow_any_hit.module);
         device.destroyShaderModule(model.shaders.ambient_occlusion_any_hit.module);
+        device.destroyShaderModule(model.shaders.prepass_intersection.module);
+        device.destroyShaderModule(model.shaders.bake_distance_field.module);
     }
 }
 
-vk::ShaderModule Shader_system::compile(std::string_view shader_name, shaderc_shader_kind shader_kind, std::string_view model_name) const {
+vk::ShaderModule
+Shader_system::compile(std::string_view shader_name, shaderc_shader_kind shader_kind, std::string_view model_name, std::string_view model_map_source) const {
 
     auto file_it = std::ranges::find_if(engine_files, [shader_name](const Shader_file& shader_file) { return shader_file.name == shader_name; });
     assert(file_it != engine_files.end());
     const auto& shader_code = file_it->data;
 
     auto model_compile_options = compile_options;
-    model_compile_options.SetIncluder(std::make_unique<Includer>(engine_files, models_files, model_name));
+    model_compile_options.SetIncluder(std::make_unique<Includer>(engine_files, models_files, model_name, model_map_source));
     auto compile_result = compiler.CompileGlslToSpv(shader_code.data(), shader_code.size(), shader_kind, shader_name.data(), model_compile_options);
     if (compile_result.GetCompilationStatus() != shaderc_compilation_status_success) {
         spdlog::error("GLSL compilation error: {}", compile_result.GetErrorMessage());
@@ -9,9 +9,15 @@ import tale.window;
 import tale.vulkan;
 
 namespace tale::engine {
+// Benchmarking without a headset, against a simulated runtime, see the README
+export struct Vr_test_options {
+    std::optional<vr::Scripted_head> scripted_head;
+    std::optional<size_t> frame_limit; // Rendered frames before the system stops
+};
+
 export class Vr_system final : public System {
 public:
-    Vr_system(Scene& scene, std::filesystem::path model_shader_path);
+    Vr_system(Scene& scene, std::filesystem::path model_shader_path, Vr_test_options test_options = {});
     Vr_system(const Vr_system& other) = delete;
     Vr_system(Vr_system&& other) = delete;
     Vr_system& operator=(const Vr_system& other) = delete;
@@ -30,6 +36,8 @@ private:
     vulkan::Reusable_command_pools command_pools;
     engine::Shader_system shader_system;
     vulkan::Renderer renderer;
+    std::optional<size_t> frame_limit;
+    size_t rendered_frames = 0u;
 };
 }
 
@@ -40,18 +48,23 @@ namespace tale::engine {
 static constexpr size_t size_command_buffers = 3u;
 static constexpr int init_windows_height{1080};
 
-Vr_system::Vr_system(Scene& scene, std::filesystem::path model_shader_path):
+Vr_system::Vr_system(Scene& scene, std::filesystem::path model_shader_path, Vr_test_options test_options):
     instance(),
     window(static_cast<int>(init_windows_height * instance.view_ratio), init_windows_height),
     context(window, &instance),
     session(instance),
     command_pools(context.device, context.queue_family, size_command_buffers),
     shader_system(context, scene, model_shader_path, true),
-    renderer(context, scene, size_command_buffers) {
+    renderer(context, scene, size_command_buffers),
+    frame_limit(test_options.frame_limit) {
+    session.scripted_head = test_options.scripted_head;
 
     const auto extent = session.swapchain.vk_view_extent();
     renderer.create_per_frame_data(context, scene, extent, size_command_buffers);
     renderer.create_descriptor_sets(context.descriptor_pool, size_command_buffers);
+    if (session.swapchain.storage_images) {
+        renderer.set_output_images(context, session.swapchain.color_images, true, vr::Vr_swapchain::storage_view_format);
+    }
 }
 
 bool Vr_system::step(Scene& scene) {
@@ -63,13 +76,29 @@ bool Vr_system::step(Scene& scene) {
         auto& command_buffer = command_pools.command_buffers[command_pool_id];
         auto fence = command_pools.fences[command_pool_id];
 
+        renderer.display_period = session.display_period();
         renderer.start_frame(command_buffer, command_pool_id, scene);
-        auto source_image = renderer.trace(command_buffer, command_pool_id, scene, session.swapchain.vk_view_extent());
-        session.copy_image(command_buffer, source_image);
+        // Traced in place when the swapchain allows it, saves a full resolution copy
+        const std::optional<size_t> output_image_index =
+            session.swapchain.storage_images ? std::optional<size_t>(session.swapchain_index) : std::nullopt;
+        const auto traced_image = renderer.trace(command_buffer, command_pool_id, scene, session.swapchain.vk_view_extent(), output_image_index);
+        if (output_image_index) {
+            session.set_traced_image(command_buffer, traced_image.extent);
+        } else {
+            session.copy_image(command_buffer, traced_image.image, traced_image.extent);
+        }
+        if (traced_image.depths && session.depth_image) {
+            session.copy_depth(command_buffer, traced_image.depths, traced_image.extent);
+        }
 
-        renderer.end_frame(command_buffer, fence, command_pool_id);
+        // Late latch, the cameras are only written to the GPU right before the submission
+        session.update_views(scene);
+        renderer.end_frame(command_buffer, fence, command_pool_id, scene);
 
         session.end_frame();
+        if (frame_limit && ++rendered_frames >= *frame_limit) {
+            return false;
+        }
     }
     return session.application_running;
 }
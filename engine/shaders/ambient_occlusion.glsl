@@ -0,0 +1,31 @@
+// Flags of each instance, written by Tlas::write_ambient_occlusion_flags
+#define AMBIENT_OCCLUDER_FLAG 0x01u // The instance occludes its own ambient
+#define AMBIENT_OVERLAP_FLAG 0x02u // Another occluding instance is close enough
+
+// Ambient occlusion rays skip the instance whose occlusion is already sampled, -1 for none
+struct Ambient_occlusion_payload
+{
+    float ao;
+    int skipped_instance;
+};
+
+// Largest sample offset of ambient_occlusion, a sample is at the ray parameter offset * length(direction)
+#define AMBIENT_OCCLUSION_SAMPLE_REACH 0.071
+
+// Occlusion by the model around a point, from a few distances sampled along the normal
+// Needs the model map function
+float ambient_occlusion(in vec3 origin, in vec3 direction)
+{
+    const float len = length(direction);
+
+	float occlusion = 0.0;
+    float scale = 1.0;
+    for(int i = 0; i < 5; i++)
+    {
+        float h = 0.001 + 0.07 * float(i) / 4.0;
+        float d = map(origin + h * len * direction).distance;
+        occlusion += max(0, h - d) * scale;
+        scale *= 0.95;
+    }
+    return clamp(1.0 - 3.0 * occlusion, 0.0, 1.0);
+}
@@ -0,0 +1,96 @@
+struct Pose
+{
+    vec4 rotation;
+    vec3 position;
+};
+
+struct Fov
+{
+    float left;
+    float right;
+    float up;
+    float down;
+};
+
+struct Camera
+{
+    Pose pose;
+    Fov fov;
+};
+
+// Written right before the submission with the latest poses, see Renderer::end_frame
+layout(binding = 9, set = 0, scalar) uniform Cameras {
+    Camera left;
+    Camera right;
+    Camera previous_left; // Cameras the previous frame was traced with
+    Camera previous_right;
+} cameras;
+
+#include "frame.glsl"
+
+// In stereo the launches have one layer per eye, the invocations of a warp never straddle the two eyes
+uint launch_eye(out uvec2 eye_id, out uvec2 eye_size)
+{
+    eye_id = gl_LaunchIDEXT.xy;
+    eye_size = gl_LaunchSizeEXT.xy;
+#ifdef STEREO
+    return gl_LaunchIDEXT.z;
+#else
+    return 0;
+#endif
+}
+
+// The eyes stay side by side in the images
+ivec2 eye_image_pixel(in uint eye, in uvec2 eye_id, in uvec2 eye_size)
+{
+    return ivec2(eye_id.x + eye * eye_size.x, eye_id.y);
+}
+
+// Size of each eye in the traced part of the images
+uvec2 eye_size_of(in uvec2 extent)
+{
+#ifdef STEREO
+    return uvec2(extent.x / 2, extent.y);
+#else
+    return extent;
+#endif
+}
+
+uvec2 trace_eye_size()
+{
+    return eye_size_of(frame.trace_extent);
+}
+
+Camera eye_camera(in uint eye)
+{
+    return eye == 0 ? cameras.left : cameras.right;
+}
+
+Camera previous_eye_camera(in uint eye)
+{
+    return eye == 0 ? cameras.previous_left : cameras.previous_right;
+}
+
+vec3 camera_ray_direction(in Camera camera, in vec2 pixel_uv)
+{
+    vec3 direction = vec3(
+        1.0,
+        -(tan(camera.fov.left) + (pixel_uv.x) * (tan(camera.fov.right) - tan(camera.fov.left))),
+        tan(camera.fov.up) + (pixel_uv.y) * (tan(camera.fov.down) - tan(camera.fov.up)));
+
+    direction = direction + 2.0 * cross(camera.pose.rotation.xyz, cross(camera.pose.rotation.xyz, direction) + camera.pose.rotation.w * direction);
+    return normalize(direction);
+}
+
+// Inverse of camera_ray_direction, the depth along the camera axis is negative behind the camera
+vec2 camera_pixel_uv(in Camera camera, in vec3 position, out float depth)
+{
+    const vec3 inverse_rotation = -camera.pose.rotation.xyz;
+    vec3 local = position - camera.pose.position;
+    local = local + 2.0 * cross(inverse_rotation, cross(inverse_rotation, local) + camera.pose.rotation.w * local);
+    depth = local.x;
+    const vec2 tangent = vec2(-local.y, local.z) / local.x;
+    return vec2(
+        (tangent.x - tan(camera.fov.left)) / (tan(camera.fov.right) - tan(camera.fov.left)),
+        (tangent.y - tan(camera.fov.up)) / (tan(camera.fov.down) - tan(camera.fov.up)));
+}
@@ -1,3 +1,5 @@
+#include "hit.glsl"
+
 struct Pose
 {
     vec4 rotation;
@@ -26,13 +28,21 @@ struct Light
     vec3 color;
 };
 
-struct Hit
+// Reported by primary.rint with the hit, the map distance of the last step and the level it was evaluated at
+struct Primary_hit_attributes
 {
     float distance;
-    uint material_id;
+    uint lod;
 };
 
-layout(push_constant, scalar) uniform Eye {
+struct Aabb
+{
+    vec3 min;
+    vec3 max;
+};
+
+// Left camera of the Cameras buffer of camera.glsl
+layout(binding = 9, set = 0, scalar) uniform Eye {
     Pose pose;
     Fov fov;
 } eye;
@@ -43,4 +53,27 @@ float get_pixel_radius()
         tan(eye.fov.up) - tan(eye.fov.down));
     pixel_area = pixel_area / vec2(gl_LaunchSizeEXT.xy);
     return min(pixel_area.x, pixel_area.y) * 0.5;
+}
+
+// Camera distances where the maps switch to the levels 1 and 2, set per model by the Raytracing_pipeline
+layout(constant_id = 0) const float lod_distance_1 = 8.0;
+layout(constant_id = 1) const float lod_distance_2 = 32.0;
+
+// One level for a whole invocation, from the camera distance of the ray at parameter t
+// Secondary rays start from a shaded point, they stay at least as coarse as the primary ray of this point
+void set_map_lod(in float t)
+{
+    const float camera_distance = distance(eye.pose.position, gl_WorldRayOriginEXT) + t * length(gl_WorldRayDirectionEXT);
+    map_lod = camera_distance < lod_distance_1 ? 0u : (camera_distance < lod_distance_2 ? 1u : 2u);
+}
+
+// Distances of the ray entry and exit of the box, no intersection if entry > exit
+vec2 intersect_aabb(in vec3 origin, in vec3 direction, in Aabb aabb)
+{
+    const vec3 inverse_direction = 1.0 / direction;
+    const vec3 t0 = (aabb.min - origin) * inverse_direction;
+    const vec3 t1 = (aabb.max - origin) * inverse_direction;
+    const vec3 t_near = min(t0, t1);
+    const vec3 t_far = max(t0, t1);
+    return vec2(max(max(t_near.x, t_near.y), t_near.z), min(min(t_far.x, t_far.y), t_far.z));
 }
\ No newline at end of file
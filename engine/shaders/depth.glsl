@@ -0,0 +1,27 @@
+// Depth buffer submitted to the compositor with the color, see Session::copy_depth
+// Rows span the whole images, DEPTH_NEAR and DEPTH_FAR come from Scene_shaders::depth_range
+
+layout(binding = 12, set = 0, scalar) buffer Depths { float d[]; } depths;
+
+// Depth of a perspective projection in [0, 1], along the camera axis rather than the ray
+float projected_depth(in Camera camera, in vec3 direction, in float distance)
+{
+    if (distance >= MISS_DISTANCE)
+    {
+        return 1.0;
+    }
+    const vec3 axis = vec3(1.0, 0.0, 0.0);
+    const vec3 forward = axis + 2.0 * cross(camera.pose.rotation.xyz, cross(camera.pose.rotation.xyz, axis) + camera.pose.rotation.w * axis);
+    const float depth = clamp(distance * dot(direction, forward), DEPTH_NEAR, DEPTH_FAR);
+    return DEPTH_FAR * (depth - DEPTH_NEAR) / (depth * (DEPTH_FAR - DEPTH_NEAR));
+}
+
+void store_depth(in ivec2 pixel, in uint image_width, in float depth)
+{
+    depths.d[pixel.y * image_width + pixel.x] = depth;
+}
+
+float load_depth(in ivec2 pixel, in uint image_width)
+{
+    return depths.d[pixel.y * image_width + pixel.x];
+}
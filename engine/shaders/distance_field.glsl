@@ -0,0 +1,28 @@
+// Map of the models with a baked distance field, the Shader_system includes it after the exact map renamed exact_map
+// The distance is interpolated between the voxels and the material comes from the closest voxel
+layout(binding = 8, set = 0) uniform sampler3D distance_fields[DISTANCE_FIELD_COUNT];
+
+// Same tier for the whole instance, close to the camera the exact map keeps the small details
+bool use_distance_field()
+{
+    return distance(gl_ObjectToWorldEXT[3], eye.pose.position) > DISTANCE_FIELD_LOD_DISTANCE;
+}
+
+Hit map(in vec3 position)
+{
+    if (!use_distance_field())
+    {
+        return exact_map(position);
+    }
+    const vec3 size = DISTANCE_FIELD_MAX - DISTANCE_FIELD_MIN;
+    const vec3 uvw = (position - DISTANCE_FIELD_MIN) / size;
+    const vec3 clamped_uvw = clamp(uvw, 0.0, 1.0);
+    const float distance = textureLod(distance_fields[DISTANCE_FIELD_INDEX], clamped_uvw, 0.0).r;
+
+    const ivec3 resolution = textureSize(distance_fields[DISTANCE_FIELD_INDEX], 0);
+    const ivec3 voxel = min(ivec3(clamped_uvw * vec3(resolution)), resolution - 1);
+    const float material_id = texelFetch(distance_fields[DISTANCE_FIELD_INDEX], voxel, 0).g;
+
+    // Outside of the box, add the distance to the box, the sampled field stops at its border
+    return Hit(distance + length((uvw - clamped_uvw) * size), uint(material_id + 0.5));
+}
@@ -0,0 +1,22 @@
+// Fixed foveation, the rays get sparser away from the projection center of each eye
+// A block traces one pixel out of rate² and foveation_reconstruct.rgen interpolates the others
+// FOVEATION_RADIUS_1 and FOVEATION_RADIUS_2 are the tangents of the angles where the rate goes to 2 then 4
+#define FOVEATION_BLOCK_SIZE 4
+
+// Same rate for the whole block, the traced pixels of neighbouring blocks stay aligned
+uint foveation_rate(in Camera camera, in uvec2 eye_id, in uvec2 eye_size)
+{
+    const uvec2 block = eye_id / FOVEATION_BLOCK_SIZE;
+    const vec2 block_uv = (vec2(block * FOVEATION_BLOCK_SIZE) + 0.5 * FOVEATION_BLOCK_SIZE) / vec2(eye_size);
+    const vec2 tangent = vec2(
+        mix(tan(camera.fov.left), tan(camera.fov.right), block_uv.x),
+        mix(tan(camera.fov.up), tan(camera.fov.down), block_uv.y));
+    const float radius = length(tangent);
+    return radius < FOVEATION_RADIUS_1 ? 1u : (radius < FOVEATION_RADIUS_2 ? 2u : 4u);
+}
+
+// The pixel of a cell of rate² pixels that is traced
+uvec2 foveation_traced_pixel(in uvec2 eye_id, in uint rate)
+{
+    return eye_id & ~uvec2(rate - 1u);
+}
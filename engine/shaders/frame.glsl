@@ -0,0 +1,7 @@
+// Push constants of the raygens and of primary.rchit, see Frame_constants
+layout(push_constant, scalar) uniform Frame {
+    uvec2 trace_extent; // Part of the images traced this frame, smaller than the images under load
+    uvec2 previous_trace_extent; // Zero when there is no history to reproject
+    uint index;
+    uint static_instance_count; // The TLAS instances of static entities come first
+} frame;
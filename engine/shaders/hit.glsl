@@ -0,0 +1,9 @@
+// Result of the model map functions, also included by the compute shaders
+struct Hit
+{
+    float distance;
+    uint material_id;
+};
+
+// Detail level the model maps can read, 0 is the most detailed, the ray tracing shaders set it with set_map_lod
+uint map_lod = 0u;
@@ -0,0 +1,10 @@
+// A prepass texel covers a block of PREPASS_BLOCK_SIZE² pixels of each eye
+#define PREPASS_BLOCK_SIZE 4
+#define PREPASS_TMIN 0.2
+#define PREPASS_TMAX 120.0
+
+// Texels of each eye written by the prepass, the images are larger when the resolution is scaled down
+uvec2 prepass_eye_size(in uvec2 eye_size)
+{
+    return (eye_size + PREPASS_BLOCK_SIZE - 1) / PREPASS_BLOCK_SIZE;
+}
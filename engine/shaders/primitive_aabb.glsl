@@ -0,0 +1,8 @@
+// AABBs of the BLAS primitives, the bounding box or the bricks of each model
+layout(binding = 4, set = 0, scalar) buffer Aabbs { Aabb a[]; } aabbs;
+
+// Object space interval of the ray inside the AABB of the primitive being intersected
+vec2 primitive_interval()
+{
+    return intersect_aabb(gl_ObjectRayOriginEXT, gl_ObjectRayDirectionEXT, aabbs.a[gl_InstanceCustomIndexEXT + gl_PrimitiveID]);
+}
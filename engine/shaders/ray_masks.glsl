@@ -0,0 +1,4 @@
+// Instance mask bits, must match the visibility mask written by Tlas::update
+#define PRIMARY_RAY_MASK 0x01
+#define SHADOW_RAY_MASK 0x02
+#define AMBIENT_OCCLUSION_RAY_MASK 0x04
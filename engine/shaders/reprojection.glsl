@@ -0,0 +1,65 @@
+// Temporal reprojection, far pixels reuse the color the previous frame traced for the same point
+// A history texel holds the encoded color and the hit distance of a pixel, the Renderer swaps the two histories every frame
+// The distance is negated when the hit was on a dynamic entity, those pixels are always traced again
+// A dynamic entity moving in front of a reprojected static pixel is only seen at the next refresh of the pixel
+// REPROJECTION_MIN_DISTANCE, REPROJECTION_TOLERANCE and REPROJECTION_REFRESH_PERIOD come from the Shader_system
+
+layout(binding = 10, set = 0, rgba16f) uniform image2D previous_history;
+layout(binding = 11, set = 0, rgba16f) uniform image2D history;
+
+bool inside_eye(in vec2 uv, in float depth)
+{
+    return depth > 0.0 && all(greaterThanEqual(uv, vec2(0.0))) && all(lessThan(uv, vec2(1.0)));
+}
+
+// Every pixel is traced again at least once per refresh period, along diagonals to spread the rays over the image
+bool refreshed(in uvec2 eye_id)
+{
+    return (eye_id.x + 3u * eye_id.y + frame.index) % REPROJECTION_REFRESH_PERIOD == 0u;
+}
+
+// Color and distance of the previous frame along a ray of the current one, false when the ray has to be traced
+// The distance is only known after the tracing, guess it from the history where the direction was then check the previous hit point
+bool reproject(in uint eye, in uvec2 eye_id, in vec3 direction, out vec4 reprojected)
+{
+    const uvec2 previous_eye_size = eye_size_of(frame.previous_trace_extent);
+    if (previous_eye_size.x == 0u || refreshed(eye_id))
+    {
+        return false;
+    }
+    const Camera camera = eye_camera(eye);
+    const Camera previous_camera = previous_eye_camera(eye);
+
+    // The rotation of the head dominates for far pixels
+    float depth;
+    vec2 uv = camera_pixel_uv(previous_camera, previous_camera.pose.position + direction, depth);
+    if (!inside_eye(uv, depth))
+    {
+        return false;
+    }
+    const float guessed_distance = abs(imageLoad(previous_history, eye_image_pixel(eye, uvec2(uv * vec2(previous_eye_size)), previous_eye_size)).a);
+    const vec3 position = camera.pose.position + guessed_distance * direction;
+    uv = camera_pixel_uv(previous_camera, position, depth);
+    if (!inside_eye(uv, depth))
+    {
+        return false;
+    }
+    const uvec2 previous_id = uvec2(uv * vec2(previous_eye_size));
+    const vec4 previous = imageLoad(previous_history, eye_image_pixel(eye, previous_id, previous_eye_size));
+    // Also rejects the dynamic hits
+    if (previous.a < REPROJECTION_MIN_DISTANCE)
+    {
+        return false;
+    }
+
+    // Disoccluded when the previous pixel saw another surface
+    const vec3 previous_direction = camera_ray_direction(previous_camera, (vec2(previous_id) + 0.5) / vec2(previous_eye_size));
+    const vec3 previous_position = previous_camera.pose.position + previous.a * previous_direction;
+    if (distance(previous_position, position) > REPROJECTION_TOLERANCE * previous.a)
+    {
+        return false;
+    }
+    // A miss stays a miss, its depth is the far plane
+    reprojected = vec4(previous.rgb, previous.a >= MISS_DISTANCE ? MISS_DISTANCE : distance(camera.pose.position, previous_position));
+    return true;
+}
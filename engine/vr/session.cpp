@@ -12,6 +12,54 @@ import vulkan_hpp;
 import tale.scene;
 
 namespace tale::vr {
+// Calls xrWaitFrame on its own thread, waiting for the next frame overlaps the recording and the submission of the current one
+class Frame_pacer {
+public:
+    struct Frame {
+        xr::FrameState state;
+        std::chrono::nanoseconds wait_time; // Blocked in xrWaitFrame
+        std::chrono::steady_clock::time_point paced_time; // When xrWaitFrame returned
+    };
+
+    explicit Frame_pacer(xr::Session session);
+    Frame_pacer(const Frame_pacer& other) = delete;
+    Frame_pacer(Frame_pacer&& other) = delete;
+    Frame_pacer& operator=(const Frame_pacer& other) = delete;
+    Frame_pacer& operator=(Frame_pacer&& other) = delete;
+    ~Frame_pacer() = default;
+
+    // Blocks until the runtime paces the next frame
+    [[nodiscard]] Frame next_frame();
+    // The next xrWaitFrame only starts once the frame returned by next_frame has begun
+    void frame_began();
+
+private:
+    xr::Session session;
+    std::mutex mutex;
+    std::condition_variable_any condition;
+    std::optional<Frame> frame;
+    std::exception_ptr error;
+    bool can_wait = true;
+    std::jthread thread; // Last, stopped and joined before the members it uses are destroyed
+
+    void run(std::stop_token stop_token);
+};
+
+// Time spent in each phase of the rendered frames, logged every frame_timings_period frames
+struct Frame_timings {
+    std::chrono::nanoseconds wait{};
+    std::chrono::nanoseconds queued{}; // From the end of xrWaitFrame to xrBeginFrame
+    std::chrono::nanoseconds render{}; // From xrBeginFrame to xrEndFrame
+    size_t frames = 0u;
+};
+
+// Motion of the head replacing the tracked poses, for runtimes without hardware like the simulated HMD of Monado
+export struct Scripted_head {
+    float yaw_amplitude = 0.8f; // Radians around the vertical
+    float sway_amplitude = 0.2f; // Meters sideways
+    float period = 4.0f; // Seconds
+};
+
 export class Session {
 public:
     xr::Session session;
@@ -19,6 +67,9 @@ public:
     bool session_running = false;
     bool application_running = true;
     vk::Image swapchain_image;
+    uint32_t swapchain_index = 0u;
+    vk::Image depth_image; // Null without depth swapchain
+    std::optional<Scripted_head> scripted_head;
 
     Session(Instance& instance);
     Session(const Session& other) = delete;
@@ -31,23 +82,86 @@ public:
     // void draw_frame(Scene& scene, std::vector<std::unique_ptr<System>>& systems);
     void handle_state_change(xr::EventDataSessionStateChanged& event_stage_changed);
     [[nodiscard]] bool start_frame(Scene& scene);
-    void copy_image(vk::CommandBuffer command_buffer, vk::Image source_image);
+    // Locate the views again once the commands are recorded, the prediction is closer to the display time
+    void update_views(Scene& scene);
+    void copy_image(vk::CommandBuffer command_buffer, vk::Image source_image, vk::Extent2D source_extent);
+    // Hand over the swapchain image traced into directly, the layer only covers the traced extent
+    void set_traced_image(vk::CommandBuffer command_buffer, vk::Extent2D traced_extent);
+    // Depths of the traced extent, with rows of the swapchain width, for the reprojection of the compositor
+    void copy_depth(vk::CommandBuffer command_buffer, vk::Buffer depth_buffer, vk::Extent2D traced_extent);
     void end_frame();
+    [[nodiscard]] std::chrono::nanoseconds display_period() const { return std::chrono::nanoseconds(frame_state.predictedDisplayPeriod.get()); }
 
 private:
     xr::SessionState session_state;
     xr::Space stage_space;
     xr::FrameState frame_state;
+    std::optional<Frame_pacer> frame_pacer; // Runs between xrBeginSession and xrEndSession
+    Frame_timings frame_timings;
+    std::chrono::steady_clock::time_point frame_begin_time;
 
     xr::CompositionLayerProjection composition_layer{};
     std::array<xr::CompositionLayerProjectionView, 2> composition_layer_views;
+    std::array<xr::CompositionLayerDepthInfoKHR, 2> depth_infos; // Chained to the views when depth is submitted
 };
 }
 
 module :private;
 
+constexpr size_t frame_timings_period = 900u; // In rendered frames
+
 namespace tale::vr {
 
+Frame_pacer::Frame_pacer(xr::Session session):
+    session(session),
+    thread([this](std::stop_token stop_token) { run(stop_token); }) {}
+
+void Frame_pacer::run(std::stop_token stop_token) {
+    try {
+        while (true) {
+            {
+                std::unique_lock lock(mutex);
+                if (!condition.wait(lock, stop_token, [this] { return can_wait; })) {
+                    return;
+                }
+                can_wait = false;
+            }
+            const auto start = std::chrono::steady_clock::now();
+            const xr::FrameState state = session.waitFrame(xr::FrameWaitInfo());
+            const auto end = std::chrono::steady_clock::now();
+            {
+                std::lock_guard lock(mutex);
+                frame = Frame{.state = state, .wait_time = end - start, .paced_time = end};
+            }
+            condition.notify_all();
+        }
+    } catch (...) {
+        // Thrown again on the render thread
+        std::lock_guard lock(mutex);
+        error = std::current_exception();
+        condition.notify_all();
+    }
+}
+
+Frame_pacer::Frame Frame_pacer::next_frame() {
+    std::unique_lock lock(mutex);
+    condition.wait(lock, [this] { return frame.has_value() || error; });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    const Frame next = *frame;
+    frame.reset();
+    return next;
+}
+
+void Frame_pacer::frame_began() {
+    {
+        std::lock_guard lock(mutex);
+        can_wait = true;
+    }
+    condition.notify_all();
+}
+
 Session::Session(Instance& instance):
     session(instance.instance.createSession(xr::SessionCreateInfo(xr::SessionCreateFlagBits::None, instance.system_id, xr::get(instance.graphic_binding)))),
     swapchain(instance, session) {
@@ -61,12 +175,18 @@ Session::Session(Instance& instance):
         composition_layer_views[eye_id] = xr::CompositionLayerProjectionView(
             xr::Posef(), xr::Fovf(), xr::SwapchainSubImage(swapchain.color_swapchain, xr::Rect2Di(offset, xr::Extent2Di(swapchain.view_extent)), 0)
         );
+        if (swapchain.depth_swapchain) {
+            depth_infos[eye_id].subImage = xr::SwapchainSubImage(swapchain.depth_swapchain, xr::Rect2Di(offset, xr::Extent2Di(swapchain.view_extent)), 0);
+            depth_infos[eye_id].minDepth = 0.0f;
+            depth_infos[eye_id].maxDepth = 1.0f;
+        }
     }
     composition_layer =
         xr::CompositionLayerProjection(xr::CompositionLayerFlagBits::CorrectChromaticAberration, stage_space, 2u, composition_layer_views.data());
 }
 
 Session::~Session() {
+    frame_pacer.reset();
     if (session) {
         session.destroy();
     }
@@ -114,19 +234,24 @@ void Session::handle_state_change(xr::EventDataSessionStateChanged& event_stage_
     case xr::SessionState::Ready: {
         session.beginSession(xr::SessionBeginInfo(xr::ViewConfigurationType::PrimaryStereo));
         session_running = true;
+        frame_pacer.emplace(session);
         break;
     }
     case xr::SessionState::Stopping: {
+        // The runtime keeps pacing frames until xrEndSession, a pending xrWaitFrame returns
+        frame_pacer.reset();
         session.endSession();
         session_running = false;
         break;
     }
     case xr::SessionState::Exiting: {
+        frame_pacer.reset();
         session_running = false;
         application_running = false;
         break;
     }
     case xr::SessionState::LossPending: {
+        frame_pacer.reset();
         session_running = false;
         application_running = false;
         break;
@@ -160,38 +285,71 @@ void update_camera(Camera& camera, xr::Posef pose, xr::Fovf fov) {
     camera.fov.down = fov.angleDown;
 }
 
+// The stage space has y up, the views turn around the vertical and sway sideways together
+xr::Posef scripted_pose(const Scripted_head& head, xr::Posef pose, xr::Time time) {
+    const double seconds = static_cast<double>(time.get()) * 1e-9;
+    const auto phase = static_cast<float>(2.0 * std::numbers::pi * std::fmod(seconds, static_cast<double>(head.period)) / static_cast<double>(head.period));
+    const glm::quat rotation = glm::angleAxis(head.yaw_amplitude * std::sin(phase), glm::vec3(0.0f, 1.0f, 0.0f));
+    const glm::quat orientation = rotation * glm::quat(pose.orientation.w, pose.orientation.x, pose.orientation.y, pose.orientation.z);
+    const glm::vec3 position =
+        rotation * glm::vec3(pose.position.x, pose.position.y, pose.position.z) + glm::vec3(head.sway_amplitude * std::sin(2.0f * phase), 0.0f, 0.0f);
+    return xr::Posef(xr::Quaternionf(orientation.x, orientation.y, orientation.z, orientation.w), xr::Vector3f(position.x, position.y, position.z));
+}
+
 bool Session::start_frame(Scene& scene) {
     if (!session_running)
         return false;
 
-    frame_state = session.waitFrame(xr::FrameWaitInfo());
+    const Frame_pacer::Frame frame = frame_pacer->next_frame();
+    frame_state = frame.state;
     session.beginFrame(xr::FrameBeginInfo());
+    frame_pacer->frame_began();
+    frame_begin_time = std::chrono::steady_clock::now();
     const bool is_active =
         session_state == xr::SessionState::Synchronized || session_state == xr::SessionState::Visible || session_state == xr::SessionState::Focused;
     if (is_active && frame_state.shouldRender) {
+        frame_timings.wait += frame.wait_time;
+        frame_timings.queued += frame_begin_time - frame.paced_time;
+        update_views(scene);
 
-        xr::ViewState view_state{};
-        const xr::ViewLocateInfo view_locate_info(xr::ViewConfigurationType::PrimaryStereo, frame_state.predictedDisplayTime, stage_space);
-        auto views = session.locateViewsToVector(view_locate_info, &(view_state.operator XrViewState&()));
-
-        for (size_t eye_id = 0u; eye_id < 2u; eye_id++) {
-            update_camera(scene.cameras[eye_id], views[eye_id].pose, views[eye_id].fov);
-            scene.cameras[eye_id].pose.position += scene.center_play_area;
-
-            composition_layer_views[eye_id].pose = views[eye_id].pose;
-            composition_layer_views[eye_id].fov = views[eye_id].fov;
-        }
-
-        uint32_t swapchain_index = swapchain.color_swapchain.acquireSwapchainImage(xr::SwapchainImageAcquireInfo());
+        swapchain_index = swapchain.color_swapchain.acquireSwapchainImage(xr::SwapchainImageAcquireInfo());
         swapchain.color_swapchain.waitSwapchainImage(xr::SwapchainImageWaitInfo(xr::Duration::infinite()));
         swapchain_image = swapchain.color_images[swapchain_index];
+        if (swapchain.depth_swapchain) {
+            const uint32_t depth_index = swapchain.depth_swapchain.acquireSwapchainImage(xr::SwapchainImageAcquireInfo());
+            swapchain.depth_swapchain.waitSwapchainImage(xr::SwapchainImageWaitInfo(xr::Duration::infinite()));
+            depth_image = swapchain.depth_images[depth_index];
+        }
         return true;
     }
     session.endFrame(xr::FrameEndInfo(frame_state.predictedDisplayTime, xr::EnvironmentBlendMode::Opaque, 0u, nullptr));
     return false;
 }
 
-void Session::copy_image(vk::CommandBuffer command_buffer, vk::Image source_image) {
+void Session::update_views(Scene& scene) {
+    xr::ViewState view_state{};
+    const xr::ViewLocateInfo view_locate_info(xr::ViewConfigurationType::PrimaryStereo, frame_state.predictedDisplayTime, stage_space);
+    auto views = session.locateViewsToVector(view_locate_info, &(view_state.operator XrViewState&()));
+
+    if (scripted_head) {
+        for (auto& view : views) {
+            view.pose = scripted_pose(*scripted_head, view.pose, frame_state.predictedDisplayTime);
+        }
+    }
+
+    // The layer is submitted with the poses used for the rendering
+    for (size_t eye_id = 0u; eye_id < 2u; eye_id++) {
+        update_camera(scene.cameras[eye_id], views[eye_id].pose, views[eye_id].fov);
+        scene.cameras[eye_id].pose.position += scene.center_play_area;
+
+        composition_layer_views[eye_id].pose = views[eye_id].pose;
+        composition_layer_views[eye_id].fov = views[eye_id].fov;
+        depth_infos[eye_id].nearZ = scene.shaders.depth_range[0];
+        depth_infos[eye_id].farZ = scene.shaders.depth_range[1];
+    }
+}
+
+void Session::copy_image(vk::CommandBuffer command_buffer, vk::Image source_image, vk::Extent2D source_extent) {
     {
         vk::ImageMemoryBarrier2 memory_barrier{
             .srcStageMask = vk::PipelineStageFlagBits2::eTopOfPipe,
@@ -211,10 +369,7 @@ void Session::copy_image(vk::CommandBuffer command_buffer, vk::Image source_imag
         vk::ImageBlit{
             .srcSubresource = {.aspectMask = vk::ImageAspectFlagBits::eColor, .mipLevel = 0u, .baseArrayLayer = 0u, .layerCount = 1u},
             .srcOffsets =
-                std::array{
-                    vk::Offset3D{0, 0, 0},
-                    vk::Offset3D{static_cast<int32_t>(swapchain.view_extent.width * 2), static_cast<int32_t>(swapchain.view_extent.height), 1}
-                },
+                std::array{vk::Offset3D{0, 0, 0}, vk::Offset3D{static_cast<int32_t>(source_extent.width), static_cast<int32_t>(source_extent.height), 1}},
             .dstSubresource = {.aspectMask = vk::ImageAspectFlagBits::eColor, .mipLevel = 0u, .baseArrayLayer = 0u, .layerCount = 1u},
             .dstOffsets =
                 std::array{
@@ -240,12 +395,111 @@ void Session::copy_image(vk::CommandBuffer command_buffer, vk::Image source_imag
     }
 }
 
+void Session::set_traced_image(vk::CommandBuffer command_buffer, vk::Extent2D traced_extent) {
+    // The compositor upscales the traced part, the eyes stay side by side
+    const xr::Extent2Di eye_extent(static_cast<int32_t>(traced_extent.width / 2u), static_cast<int32_t>(traced_extent.height));
+    for (size_t eye_id = 0u; eye_id < 2u; eye_id++) {
+        const xr::Offset2Di offset(eye_id == 0 ? 0 : eye_extent.width, 0);
+        composition_layer_views[eye_id].subImage.imageRect = xr::Rect2Di(offset, eye_extent);
+    }
+
+    // Left in transfer source by the copy to the window
+    vk::ImageMemoryBarrier2 memory_barrier{
+        .srcStageMask = vk::PipelineStageFlagBits2::eTransfer,
+        .srcAccessMask = vk::AccessFlagBits2::eTransferRead,
+        .dstStageMask = vk::PipelineStageFlagBits2::eBottomOfPipe,
+        .dstAccessMask = {},
+        .oldLayout = vk::ImageLayout::eTransferSrcOptimal,
+        .newLayout = vk::ImageLayout::eColorAttachmentOptimal,
+        .image = swapchain_image,
+        .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor, .baseMipLevel = 0, .levelCount = 1u, .baseArrayLayer = 0, .layerCount = 1}
+    };
+    command_buffer.pipelineBarrier2(vk::DependencyInfo{.imageMemoryBarrierCount = 1, .pImageMemoryBarriers = &memory_barrier});
+}
+
+void Session::copy_depth(vk::CommandBuffer command_buffer, vk::Buffer depth_buffer, vk::Extent2D traced_extent) {
+    const xr::Extent2Di eye_extent(static_cast<int32_t>(traced_extent.width / 2u), static_cast<int32_t>(traced_extent.height));
+    for (size_t eye_id = 0u; eye_id < 2u; eye_id++) {
+        const xr::Offset2Di offset(eye_id == 0 ? 0 : eye_extent.width, 0);
+        depth_infos[eye_id].subImage.imageRect = xr::Rect2Di(offset, eye_extent);
+        composition_layer_views[eye_id].next = &depth_infos[eye_id];
+    }
+
+    const vk::ImageSubresourceRange subresource_range{
+        .aspectMask = vk::ImageAspectFlagBits::eDepth, .baseMipLevel = 0, .levelCount = 1u, .baseArrayLayer = 0, .layerCount = 1
+    };
+    {
+        const vk::BufferMemoryBarrier2 buffer_barrier{
+            .srcStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eTransfer,
+            .dstAccessMask = vk::AccessFlagBits2::eTransferRead,
+            .buffer = depth_buffer,
+            .size = VK_WHOLE_SIZE
+        };
+        const vk::ImageMemoryBarrier2 image_barrier{
+            .srcStageMask = vk::PipelineStageFlagBits2::eTopOfPipe,
+            .srcAccessMask = {},
+            .dstStageMask = vk::PipelineStageFlagBits2::eTransfer,
+            .dstAccessMask = vk::AccessFlagBits2::eTransferWrite,
+            .oldLayout = vk::ImageLayout::eUndefined,
+            .newLayout = vk::ImageLayout::eTransferDstOptimal,
+            .image = depth_image,
+            .subresourceRange = subresource_range
+        };
+        command_buffer.pipelineBarrier2(vk::DependencyInfo{
+            .bufferMemoryBarrierCount = 1, .pBufferMemoryBarriers = &buffer_barrier, .imageMemoryBarrierCount = 1, .pImageMemoryBarriers = &image_barrier
+        });
+    }
+
+    command_buffer.copyBufferToImage(
+        depth_buffer, depth_image, vk::ImageLayout::eTransferDstOptimal,
+        vk::BufferImageCopy{
+            .bufferOffset = 0u,
+            .bufferRowLength = static_cast<uint32_t>(swapchain.view_extent.width * 2),
+            .bufferImageHeight = 0u,
+            .imageSubresource = {.aspectMask = vk::ImageAspectFlagBits::eDepth, .mipLevel = 0u, .baseArrayLayer = 0u, .layerCount = 1u},
+            .imageOffset = {0, 0, 0},
+            .imageExtent = {traced_extent.width, traced_extent.height, 1u}
+        }
+    );
+
+    {
+        const vk::ImageMemoryBarrier2 memory_barrier{
+            .srcStageMask = vk::PipelineStageFlagBits2::eTransfer,
+            .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eBottomOfPipe,
+            .dstAccessMask = {},
+            .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+            .newLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
+            .image = depth_image,
+            .subresourceRange = subresource_range
+        };
+        command_buffer.pipelineBarrier2(vk::DependencyInfo{.imageMemoryBarrierCount = 1, .pImageMemoryBarriers = &memory_barrier});
+    }
+}
+
 void Session::end_frame() {
     swapchain.color_swapchain.releaseSwapchainImage(xr::SwapchainImageReleaseInfo());
+    if (swapchain.depth_swapchain) {
+        swapchain.depth_swapchain.releaseSwapchainImage(xr::SwapchainImageReleaseInfo());
+    }
     std::vector<xr::CompositionLayerBaseHeader*> layers_pointers;
     layers_pointers.push_back(reinterpret_cast<xr::CompositionLayerBaseHeader*>(&composition_layer));
     session.endFrame(xr::FrameEndInfo(
         frame_state.predictedDisplayTime, xr::EnvironmentBlendMode::Opaque, static_cast<uint32_t>(layers_pointers.size()), layers_pointers.data()
     ));
+
+    frame_timings.render += std::chrono::steady_clock::now() - frame_begin_time;
+    if (++frame_timings.frames == frame_timings_period) {
+        const auto average = [](std::chrono::nanoseconds total) {
+            return std::chrono::duration<double, std::milli>(total).count() / static_cast<double>(frame_timings_period);
+        };
+        spdlog::info(
+            "XR frames: {:.2f} ms in xrWaitFrame, {:.2f} ms until xrBeginFrame, {:.2f} ms from xrBeginFrame to xrEndFrame on average.",
+            average(frame_timings.wait), average(frame_timings.queued), average(frame_timings.render)
+        );
+        frame_timings = Frame_timings{};
+    }
 }
 }
\ No newline at end of file
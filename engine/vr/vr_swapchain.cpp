@@ -11,10 +11,15 @@ namespace tale::vr {
 export class Vr_swapchain {
 public:
     static constexpr vk::Format required_color_format = vk::Format::eR8G8B8A8Srgb;
-    // static constexpr vk::Format required_depth_format = vk::Format::eR8G8B8A8Srgb;
+    // View of the color images when traced into, srgb formats don't support storage so the raygen encodes the colors
+    static constexpr vk::Format storage_view_format = vk::Format::eR8G8B8A8Unorm;
+    static constexpr vk::Format depth_format = vk::Format::eD32Sfloat;
     xr::Swapchain color_swapchain;
     std::vector<vk::Image> color_images;
+    xr::Swapchain depth_swapchain; // Null when the runtime has no depth_format swapchains
+    std::vector<vk::Image> depth_images;
     xr::Extent2Di view_extent;
+    bool storage_images = false; // The color images can be traced into directly through a storage_view_format view
 
     Vr_swapchain(Instance& instance, xr::Session& session);
     Vr_swapchain(const Vr_swapchain& other) = delete;
@@ -29,9 +34,7 @@ public:
 
 private:
     std::vector<xr::SwapchainImageVulkanKHR> xr_color_images;
-    // xr::Swapchain depth_swapchain;
-    // std::vector<xr::SwapchainImageVulkanKHR> xr_depth_images;
-    // std::vector<vk::Image> depth_images;
+    std::vector<xr::SwapchainImageVulkanKHR> xr_depth_images;
 };
 
 }
@@ -40,6 +43,9 @@ module :private;
 
 namespace tale::vr {
 
+// Trace into the swapchain images instead of copying a render texture into them
+constexpr bool use_storage_images = true;
+
 Vr_swapchain::Vr_swapchain(Instance& instance, xr::Session& session) {
     const std::vector<int64_t> supported_formats = session.enumerateSwapchainFormatsToVector();
 
@@ -74,8 +80,7 @@ Vr_swapchain::Vr_swapchain(Instance& instance, xr::Session& session) {
     {
         xr::SwapchainCreateInfo create_info{};
         create_info.createFlags = xr::SwapchainCreateFlagBits::None;
-        create_info.usageFlags = xr::SwapchainUsageFlagBits::TransferDst; // We could use UnorderedAccess to directly write to the image, but it might not be
-                                                                          // compatible with srgb format
+        create_info.usageFlags = xr::SwapchainUsageFlagBits::TransferDst;
         create_info.format = static_cast<int64_t>(required_color_format);
         create_info.sampleCount = view_configuration_views[0].recommendedSwapchainSampleCount;
         create_info.width = view_configuration_views[0].recommendedImageRectWidth * 2u; // One swapchain of double width
@@ -83,7 +88,21 @@ Vr_swapchain::Vr_swapchain(Instance& instance, xr::Session& session) {
         create_info.faceCount = 1;
         create_info.arraySize = 1;
         create_info.mipCount = 1;
-        color_swapchain = session.createSwapchain(create_info);
+        if (use_storage_images) {
+            // Mirrored to the window from the swapchain image, the runtime may refuse storage usage on srgb images
+            xr::SwapchainCreateInfo storage_create_info = create_info;
+            storage_create_info.usageFlags = xr::SwapchainUsageFlagBits::UnorderedAccess | xr::SwapchainUsageFlagBits::MutableFormat |
+                                             xr::SwapchainUsageFlagBits::TransferSrc | xr::SwapchainUsageFlagBits::TransferDst;
+            try {
+                color_swapchain = session.createSwapchain(storage_create_info);
+                storage_images = true;
+            } catch (const xr::exceptions::SystemError& error) {
+                spdlog::warn("Storage usage not supported for the XR swapchain, falling back to a copy: {}", error.what());
+            }
+        }
+        if (!storage_images) {
+            color_swapchain = session.createSwapchain(create_info);
+        }
 
         xr_color_images = color_swapchain.enumerateSwapchainImagesToVector<xr::SwapchainImageVulkanKHR>();
         color_images.reserve(xr_color_images.size());
@@ -92,25 +111,30 @@ Vr_swapchain::Vr_swapchain(Instance& instance, xr::Session& session) {
         }
     }
 
-    // {
-    //     xr::SwapchainCreateInfo create_info{};
-    //     create_info.createFlags = xr::SwapchainCreateFlagBits::None;
-    //     create_info.usageFlags = xr::SwapchainUsageFlagBits::TransferDst;
-    //     create_info.format = static_cast<int64_t>(required_depth_format);
-    //     create_info.sampleCount = view_configuration_views[0].recommendedSwapchainSampleCount;
-    //     create_info.width = view_configuration_views[0].recommendedImageRectWidth * 2u; // One swapchain of double width
-    //     create_info.height = view_configuration_views[0].recommendedImageRectHeight;
-    //     create_info.faceCount = 1;
-    //     create_info.arraySize = 1;
-    //     create_info.mipCount = 1;
-    //     depth_swapchain = session.createSwapchain(create_info);
-
-    //     xr_depth_images = depth_swapchain.enumerateSwapchainImagesToVector<xr::SwapchainImageVulkanKHR>();
-    //     depth_images.reserve(xr_depth_images.size());
-    //     for (const auto& image : xr_depth_images) {
-    //         depth_images.push_back(image.image);
-    //     }
-    // }
+    if (std::ranges::none_of(supported_formats, [](const auto& format) { return static_cast<int64_t>(depth_format) == format; })) {
+        spdlog::warn("Depth format not supported by the OpenXR runtime, no depth is submitted.");
+        return;
+    }
+    {
+        // Written with copies from the depth buffer of the renderer
+        xr::SwapchainCreateInfo create_info{};
+        create_info.createFlags = xr::SwapchainCreateFlagBits::None;
+        create_info.usageFlags = xr::SwapchainUsageFlagBits::TransferDst | xr::SwapchainUsageFlagBits::DepthStencilAttachment;
+        create_info.format = static_cast<int64_t>(depth_format);
+        create_info.sampleCount = view_configuration_views[0].recommendedSwapchainSampleCount;
+        create_info.width = view_configuration_views[0].recommendedImageRectWidth * 2u; // One swapchain of double width
+        create_info.height = view_configuration_views[0].recommendedImageRectHeight;
+        create_info.faceCount = 1;
+        create_info.arraySize = 1;
+        create_info.mipCount = 1;
+        depth_swapchain = session.createSwapchain(create_info);
+
+        xr_depth_images = depth_swapchain.enumerateSwapchainImagesToVector<xr::SwapchainImageVulkanKHR>();
+        depth_images.reserve(xr_depth_images.size());
+        for (const auto& image : xr_depth_images) {
+            depth_images.push_back(image.image);
+        }
+    }
 }
 
 Vr_swapchain::~Vr_swapchain() {
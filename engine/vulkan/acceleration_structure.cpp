@@ -3,6 +3,7 @@ module;
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/quaternion.hpp>
 #include <glm/gtx/transform.hpp>
+#include <spdlog/spdlog.h>
 #include <vma_includes.hpp>
 export module tale.vulkan.acceleration_structure;
 import std;
@@ -11,12 +12,14 @@ import tale.scene;
 import tale.vulkan.context;
 import tale.vulkan.buffer;
 import tale.vulkan.command_buffer;
+import tale.vulkan.raytracing_pipeline;
 
 namespace tale::vulkan {
 class Acceleration_structure {
 public:
     vk::AccelerationStructureKHR acceleration_structure;
     Vma_buffer buffer{};
+    vk::DeviceSize size = 0u;
 
     Acceleration_structure(Context& context);
     Acceleration_structure(const Acceleration_structure& other) = delete;
@@ -27,30 +30,81 @@ public:
 
 protected:
     vk::Device device;
-    Vma_buffer scratch_buffer{};
-    vk::DeviceAddress scratch_address;
 
-    void create_buffers(Context& context, const vk::AccelerationStructureBuildSizesInfoKHR& build_size);
+    // Host commands can only access acceleration structures in host visible memory
+    void create(Context& context, vk::AccelerationStructureTypeKHR type, vk::DeviceSize structure_size, bool host_visible = false);
 };
 
 export class Blas : public Acceleration_structure {
 public:
     vk::DeviceAddress address;
+    uint32_t first_aabb;
 
-    Blas(Context& context, const Model& model);
+    Blas(Context& context, vk::DeviceSize size, uint32_t first_aabb, bool host_visible = false);
     Blas(const Blas& other) = delete;
     Blas(Blas&& other) = default;
     Blas& operator=(const Blas& other) = delete;
     Blas& operator=(Blas&& other) = default;
     ~Blas() = default;
+};
+
+// AABBs of all the models, either the bounding box or the occupied bricks of the model
+export struct Blas_geometry {
+    std::vector<vk::AabbPositionsKHR> aabbs;
+    std::vector<uint32_t> first_aabb;
+    std::vector<uint32_t> aabb_count;
+
+    explicit Blas_geometry(const std::vector<Model>& models);
+};
+
+// Record the build of every model BLAS in a single command, the scratch buffer is released with the batch
+export [[nodiscard]] std::vector<Blas>
+build_blas(Context& context, const Blas_geometry& geometry, vk::DeviceAddress aabbs_address, Upload_batch& upload_batch);
+
+// Build every model BLAS on the CPU worker threads, then record their compacted copy to device local memory in the batch
+// Needs Context::acceleration_structure_host_commands
+export [[nodiscard]] std::vector<Blas> build_blas_on_host(Context& context, const Blas_geometry& geometry, Upload_batch& upload_batch);
+
+// Query the compacted size of freshly built BLAS, then copy them into right-sized buffers
+export class Blas_compaction {
+public:
+    Blas_compaction(Context& context, const std::vector<Blas>& blas, vk::CommandBuffer command_buffer);
+    Blas_compaction(const Blas_compaction& other) = delete;
+    Blas_compaction(Blas_compaction&& other) = delete;
+    Blas_compaction& operator=(const Blas_compaction& other) = delete;
+    Blas_compaction& operator=(Blas_compaction&& other) = delete;
+    ~Blas_compaction();
+
+    // The queries are read back, the batch that recorded them must be done
+    void compact(Context& context, std::vector<Blas>& blas, Upload_batch& upload_batch);
 
 private:
-    Vma_buffer aabb_buffer{};
+    vk::Device device;
+    vk::QueryPool query_pool;
+};
+
+// Refits keep the tree topology, its quality drops as the instances move away from where they were at the last build
+export struct Tlas_rebuild_policy {
+    uint32_t max_refits = 300u;
+    float max_displacement = 20.0f; // Sum over the instances of their move since the last build, rotations count as the arc of their bounding sphere
+    bool prefer_fast_build = false; // For scenes that rebuild often, at the cost of trace performance
+};
+
+export struct Tlas_statistics {
+    uint64_t builds = 0u;
+    uint64_t refits = 0u;
+    uint64_t skipped = 0u; // No dynamic instance moved
+    uint32_t refits_since_build = 0u;
+    float displacement_since_build = 0.0f;
 };
 
 export class Tlas : public Acceleration_structure {
 public:
-    Tlas(Context& context, const std::vector<Blas>& blas, Scene& scene);
+    Tlas_statistics statistics;
+    // Ambient occlusion flags of each instance, see primary.rchit
+    Vma_buffer ambient_occlusion_flags{};
+
+    Tlas(Context& context, const std::vector<Blas>& blas, Scene& scene, vk::CommandBuffer command_buffer, Tlas_rebuild_policy rebuild_policy = {});
     Tlas(const Tlas& other) = delete;
     Tlas(Tlas&& other) = default;
     Tlas& operator=(const Tlas& other) = delete;
@@ -58,11 +112,29 @@ public:
     ~Tlas() = default;
 
     void update(vk::CommandBuffer command_buffer, bool first_build, const Scene& scene);
+    // The instances of static entities are the first ones
+    [[nodiscard]] size_t static_instance_count() const { return static_count; }
 
 private:
     Vma_buffer instance_buffer{};
+    Vma_buffer scratch_buffer{};
+    vk::DeviceAddress scratch_address;
     std::vector<vk::DeviceAddress> blas_addresses;
+    std::vector<uint32_t> blas_first_aabbs;
+    std::vector<Visibility> model_visibilities;
+    std::vector<float> model_radii;
+    std::array<std::vector<glm::vec3>, 2> model_bounds; // Centers and half extents
     vk::AccelerationStructureGeometryKHR acceleration_structure_geometry;
+    Tlas_rebuild_policy policy;
+    vk::BuildAccelerationStructureFlagsKHR build_flags;
+    std::vector<size_t> instance_order; // Entity indices, the static ones first
+    size_t static_count = 0u;
+    std::vector<Transform> built_transforms; // Entities at the last build
+    std::vector<Transform> written_transforms; // Entities in the instance buffer
+
+    [[nodiscard]] vk::AccelerationStructureInstanceKHR instance(const Entity& entity) const;
+    [[nodiscard]] float displacement(const Scene& scene) const;
+    void write_ambient_occlusion_flags(const Scene& scene);
 };
 
 }
@@ -71,15 +143,35 @@ module :private;
 
 namespace tale::vulkan {
 
+// Bits of ray_masks.glsl
+constexpr uint8_t primary_ray_mask = 0x01;
+constexpr uint8_t shadow_ray_mask = 0x02;
+constexpr uint8_t ambient_occlusion_ray_mask = 0x04;
+
+// Bits of ambient_occlusion.glsl
+constexpr uint32_t ambient_occluder_flag = 0x01; // The instance occludes its own ambient
+constexpr uint32_t ambient_overlap_flag = 0x02; // Another occluding instance is close enough
+
+constexpr uint8_t visibility_mask(const Visibility& visibility) noexcept {
+    return static_cast<uint8_t>(
+        (visibility.primary ? primary_ray_mask : 0u) | (visibility.casts_shadow ? shadow_ray_mask : 0u) |
+        (visibility.occludes_ambient ? ambient_occlusion_ray_mask : 0u)
+    );
+}
+
+// Length of the ambient occlusion rays of primary.rchit
+constexpr float ambient_occlusion_reach = 0.5f;
+
+constexpr vk::DeviceSize align_up(vk::DeviceSize value, vk::DeviceSize alignment) noexcept { return (value + alignment - 1) & ~(alignment - 1); }
+
 Acceleration_structure::Acceleration_structure(Context& context):
     device(context.device) {}
 
 Acceleration_structure::Acceleration_structure(Acceleration_structure&& other) noexcept:
     acceleration_structure(other.acceleration_structure),
-    device(other.device),
     buffer(std::move(other.buffer)),
-    scratch_buffer(std::move(other.scratch_buffer)),
-    scratch_address(other.scratch_address) {
+    size(other.size),
+    device(other.device) {
     other.acceleration_structure = nullptr;
     other.device = nullptr;
 }
@@ -88,8 +180,7 @@ Acceleration_structure& Acceleration_structure::operator=(Acceleration_structure
     std::swap(acceleration_structure, other.acceleration_structure);
     std::swap(device, other.device);
     std::swap(buffer, other.buffer);
-    std::swap(scratch_buffer, other.scratch_buffer);
-    std::swap(scratch_address, other.scratch_address);
+    std::swap(size, other.size);
     return *this;
 }
 
@@ -100,96 +191,324 @@ Acceleration_structure::~Acceleration_structure() {
     }
 }
 
-void Acceleration_structure::create_buffers(Context& context, const vk::AccelerationStructureBuildSizesInfoKHR& build_size) {
+void Acceleration_structure::create(Context& context, vk::AccelerationStructureTypeKHR type, vk::DeviceSize structure_size, bool host_visible) {
+    size = structure_size;
     buffer = Vma_buffer(
         device, context.allocator,
         vk::BufferCreateInfo{
-            .size = build_size.accelerationStructureSize,
+            .size = size,
             .usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR |
                      vk::BufferUsageFlagBits::eShaderDeviceAddress,
             .sharingMode = vk::SharingMode::eExclusive
         },
-        VmaAllocationCreateInfo{.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE}
+        host_visible ? VmaAllocationCreateInfo{.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT, .usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST}
+                     : VmaAllocationCreateInfo{.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE}
     );
-    scratch_buffer = Vma_buffer(
-        device, context.allocator,
+    acceleration_structure = device.createAccelerationStructureKHR(
+        vk::AccelerationStructureCreateInfoKHR{.createFlags = {}, .buffer = buffer.buffer, .offset = 0u, .size = size, .type = type}
+    );
+}
+
+Blas::Blas(Context& context, vk::DeviceSize size, uint32_t first_aabb, bool host_visible):
+    Acceleration_structure(context),
+    first_aabb(first_aabb) {
+    create(context, vk::AccelerationStructureTypeKHR::eBottomLevel, size, host_visible);
+    address = device.getAccelerationStructureAddressKHR(vk::AccelerationStructureDeviceAddressInfoKHR{.accelerationStructure = acceleration_structure});
+}
+
+Blas_geometry::Blas_geometry(const std::vector<Model>& models) {
+    first_aabb.reserve(models.size());
+    aabb_count.reserve(models.size());
+    for (const auto& model : models) {
+        first_aabb.push_back(static_cast<uint32_t>(aabbs.size()));
+        const glm::vec3 min = model.bounding_box[0];
+        const glm::vec3 max = model.bounding_box[1];
+        if (model.bricks) {
+            const Brick_decomposition& bricks = *model.bricks;
+            const glm::ivec3 grid = glm::max(glm::ivec3(glm::ceil((max - min) / bricks.size)), glm::ivec3(1));
+            // A surface closer than that to the brick center might be inside the brick or its margin
+            const float reach = 0.5f * std::sqrt(3.0f) * bricks.size + bricks.margin;
+            for (int z = 0; z < grid.z; z++) {
+                for (int y = 0; y < grid.y; y++) {
+                    for (int x = 0; x < grid.x; x++) {
+                        const glm::vec3 brick_min = min + glm::vec3(x, y, z) * bricks.size;
+                        if (std::abs(bricks.distance(brick_min + 0.5f * bricks.size)) > reach)
+                            continue;
+                        const glm::vec3 aabb_min = brick_min - bricks.margin;
+                        const glm::vec3 aabb_max = brick_min + bricks.size + bricks.margin;
+                        aabbs.push_back(vk::AabbPositionsKHR{aabb_min.x, aabb_min.y, aabb_min.z, aabb_max.x, aabb_max.y, aabb_max.z});
+                    }
+                }
+            }
+            spdlog::debug("Model {}: {} bricks occupied out of {}.", model.name, aabbs.size() - first_aabb.back(), grid.x * grid.y * grid.z);
+        } else {
+            aabbs.push_back(vk::AabbPositionsKHR{min.x, min.y, min.z, max.x, max.y, max.z});
+        }
+        aabb_count.push_back(static_cast<uint32_t>(aabbs.size()) - first_aabb.back());
+    }
+}
+
+std::vector<Blas> build_blas(Context& context, const Blas_geometry& geometry, vk::DeviceAddress aabbs_address, Upload_batch& upload_batch) {
+    std::vector<Blas> blas;
+    const size_t model_count = geometry.first_aabb.size();
+    if (model_count == 0u)
+        return blas;
+
+    vk::PhysicalDeviceAccelerationStructurePropertiesKHR acceleration_structure_properties{};
+    vk::PhysicalDeviceProperties2 properties{.pNext = &acceleration_structure_properties};
+    context.physical_device.getProperties2(&properties);
+    const vk::DeviceSize scratch_alignment = acceleration_structure_properties.minAccelerationStructureScratchOffsetAlignment;
+
+    vk::AccelerationStructureGeometryDataKHR geometry_data{};
+    geometry_data.setAabbs(
+        vk::AccelerationStructureGeometryAabbsDataKHR{.data = vk::DeviceOrHostAddressConstKHR(aabbs_address), .stride = sizeof(vk::AabbPositionsKHR)}
+    );
+    const vk::AccelerationStructureGeometryKHR acceleration_structure_geometry{
+        .geometryType = vk::GeometryTypeKHR::eAabbs, .geometry = geometry_data,
+    };
+
+    std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> geometry_infos;
+    std::vector<vk::AccelerationStructureBuildRangeInfoKHR> build_ranges;
+    std::vector<vk::DeviceSize> scratch_offsets;
+    geometry_infos.reserve(model_count);
+    build_ranges.reserve(model_count);
+    scratch_offsets.reserve(model_count);
+    blas.reserve(model_count);
+    // The builds of a single command run concurrently, each one needs its own part of the scratch buffer
+    vk::DeviceSize scratch_size = 0u;
+    for (size_t i = 0u; i < model_count; i++) {
+        vk::AccelerationStructureBuildGeometryInfoKHR geometry_info{
+            .type = vk::AccelerationStructureTypeKHR::eBottomLevel,
+            .flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction,
+            .mode = vk::BuildAccelerationStructureModeKHR::eBuild,
+            .geometryCount = 1u,
+            .pGeometries = &acceleration_structure_geometry
+        };
+        const vk::AccelerationStructureBuildSizesInfoKHR build_size =
+            context.device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, geometry_info, geometry.aabb_count[i]);
+        blas.emplace_back(context, build_size.accelerationStructureSize, geometry.first_aabb[i]);
+
+        geometry_info.dstAccelerationStructure = blas.back().acceleration_structure;
+        geometry_infos.push_back(geometry_info);
+        build_ranges.push_back(vk::AccelerationStructureBuildRangeInfoKHR{
+            .primitiveCount = geometry.aabb_count[i],
+            .primitiveOffset = static_cast<uint32_t>(geometry.first_aabb[i] * sizeof(vk::AabbPositionsKHR)),
+            .firstVertex = 0u,
+            .transformOffset = 0u
+        });
+        scratch_offsets.push_back(scratch_size);
+        scratch_size += align_up(build_size.buildScratchSize, scratch_alignment);
+    }
+
+    Vma_buffer scratch_buffer(
+        context.device, context.allocator,
         vk::BufferCreateInfo{
-            .size = std::max(build_size.buildScratchSize, build_size.updateScratchSize),
+            .size = scratch_size,
             .usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress,
             .sharingMode = vk::SharingMode::eExclusive
         },
         VmaAllocationCreateInfo{.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE}
     );
-    scratch_address = device.getBufferAddress(vk::BufferDeviceAddressInfo{.buffer = scratch_buffer.buffer});
-}
+    const vk::DeviceAddress scratch_address = context.device.getBufferAddress(vk::BufferDeviceAddressInfo{.buffer = scratch_buffer.buffer});
 
-Blas::Blas(Context& context, const Model& model):
-    Acceleration_structure(context) {
-    vk::AabbPositionsKHR aabb{model.bounding_box[0].x, model.bounding_box[0].y, model.bounding_box[0].z,
-                              model.bounding_box[1].x, model.bounding_box[1].y, model.bounding_box[1].z};
+    std::vector<const vk::AccelerationStructureBuildRangeInfoKHR*> build_range_pointers;
+    build_range_pointers.reserve(build_ranges.size());
+    for (size_t i = 0u; i < geometry_infos.size(); i++) {
+        geometry_infos[i].scratchData = vk::DeviceOrHostAddressKHR(scratch_address + scratch_offsets[i]);
+        build_range_pointers.push_back(&build_ranges[i]);
+    }
 
-    aabb_buffer = Vma_buffer(
-        device, context.allocator,
-        vk::BufferCreateInfo{
-            .size = sizeof(vk::AabbPositionsKHR) * 1,
-            .usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
-                     vk::BufferUsageFlagBits::eShaderDeviceAddress
-        },
-        VmaAllocationCreateInfo{.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, .usage = VMA_MEMORY_USAGE_AUTO}
-    );
-    aabb_buffer.map();
-    aabb_buffer.copy(reinterpret_cast<void*>(&aabb), 1 * sizeof(vk::AabbPositionsKHR));
-    aabb_buffer.unmap();
+    // The AABBs are uploaded in the same batch
+    const vk::MemoryBarrier2 memory_barrier{
+        .srcStageMask = vk::PipelineStageFlagBits2::eTransfer,
+        .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+        .dstStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+        .dstAccessMask = vk::AccessFlagBits2::eShaderRead
+    };
+    upload_batch.command_buffer.pipelineBarrier2(vk::DependencyInfo{.memoryBarrierCount = 1, .pMemoryBarriers = &memory_barrier});
+    upload_batch.command_buffer.buildAccelerationStructuresKHR(geometry_infos, build_range_pointers);
 
-    const vk::DeviceAddress aabb_buffer_address = device.getBufferAddress(vk::BufferDeviceAddressInfo{.buffer = aabb_buffer.buffer});
+    upload_batch.keep_alive(std::move(scratch_buffer));
+    return blas;
+}
 
-    vk::AccelerationStructureGeometryDataKHR geometry_data{};
-    geometry_data.setAabbs(
-        vk::AccelerationStructureGeometryAabbsDataKHR{.data = vk::DeviceOrHostAddressConstKHR(aabb_buffer_address), .stride = sizeof(vk::AabbPositionsKHR)}
-    );
+// Record the copies of the BLAS into buffers of their compacted sizes, the originals are still read by the copies
+void copy_compacted(Context& context, std::vector<Blas>& blas, std::span<const vk::DeviceSize> compacted_sizes, Upload_batch& upload_batch) {
+    vk::DeviceSize original_total = 0u;
+    vk::DeviceSize compacted_total = 0u;
+    for (size_t i = 0u; i < blas.size(); i++) {
+        Blas compacted(context, compacted_sizes[i], blas[i].first_aabb);
+        upload_batch.command_buffer.copyAccelerationStructureKHR(vk::CopyAccelerationStructureInfoKHR{
+            .src = blas[i].acceleration_structure, .dst = compacted.acceleration_structure, .mode = vk::CopyAccelerationStructureModeKHR::eCompact
+        });
+        original_total += blas[i].size;
+        compacted_total += compacted_sizes[i];
+        upload_batch.keep_alive(std::move(blas[i]));
+        blas[i] = std::move(compacted);
+    }
+    spdlog::info("Compacted {} BLAS from {} to {} bytes, saved {} bytes.", blas.size(), original_total, compacted_total, original_total - compacted_total);
+}
 
+std::vector<Blas> build_blas_on_host(Context& context, const Blas_geometry& geometry, Upload_batch& upload_batch) {
+    std::vector<Blas> blas;
+    const size_t model_count = geometry.first_aabb.size();
+    if (model_count == 0u)
+        return blas;
+
+    vk::AccelerationStructureGeometryDataKHR geometry_data{};
+    geometry_data.setAabbs(vk::AccelerationStructureGeometryAabbsDataKHR{
+        .data = vk::DeviceOrHostAddressConstKHR(static_cast<const void*>(geometry.aabbs.data())), .stride = sizeof(vk::AabbPositionsKHR)
+    });
     const vk::AccelerationStructureGeometryKHR acceleration_structure_geometry{
         .geometryType = vk::GeometryTypeKHR::eAabbs, .geometry = geometry_data,
     };
 
-    vk::AccelerationStructureBuildGeometryInfoKHR geometry_info{
-        .type = vk::AccelerationStructureTypeKHR::eBottomLevel,
-        .flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace,
-        .mode = vk::BuildAccelerationStructureModeKHR::eBuild,
-        .geometryCount = 1u,
-        .pGeometries = &acceleration_structure_geometry
+    std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> geometry_infos;
+    std::vector<vk::AccelerationStructureBuildRangeInfoKHR> build_ranges;
+    std::vector<vk::DeviceSize> scratch_offsets;
+    geometry_infos.reserve(model_count);
+    build_ranges.reserve(model_count);
+    scratch_offsets.reserve(model_count);
+    blas.reserve(model_count);
+    vk::DeviceSize scratch_size = 0u;
+    for (size_t i = 0u; i < model_count; i++) {
+        vk::AccelerationStructureBuildGeometryInfoKHR geometry_info{
+            .type = vk::AccelerationStructureTypeKHR::eBottomLevel,
+            .flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction,
+            .mode = vk::BuildAccelerationStructureModeKHR::eBuild,
+            .geometryCount = 1u,
+            .pGeometries = &acceleration_structure_geometry
+        };
+        const vk::AccelerationStructureBuildSizesInfoKHR build_size =
+            context.device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eHost, geometry_info, geometry.aabb_count[i]);
+        blas.emplace_back(context, build_size.accelerationStructureSize, geometry.first_aabb[i], true);
+
+        geometry_info.dstAccelerationStructure = blas.back().acceleration_structure;
+        geometry_infos.push_back(geometry_info);
+        build_ranges.push_back(vk::AccelerationStructureBuildRangeInfoKHR{
+            .primitiveCount = geometry.aabb_count[i],
+            .primitiveOffset = static_cast<uint32_t>(geometry.first_aabb[i] * sizeof(vk::AabbPositionsKHR)),
+            .firstVertex = 0u,
+            .transformOffset = 0u
+        });
+        scratch_offsets.push_back(scratch_size);
+        scratch_size += align_up(build_size.buildScratchSize, alignof(std::max_align_t));
+    }
+
+    std::vector<std::max_align_t> scratch(scratch_size / sizeof(std::max_align_t) + 1u);
+    std::vector<const vk::AccelerationStructureBuildRangeInfoKHR*> build_range_pointers;
+    build_range_pointers.reserve(build_ranges.size());
+    for (size_t i = 0u; i < geometry_infos.size(); i++) {
+        geometry_infos[i].scratchData = vk::DeviceOrHostAddressKHR(static_cast<void*>(reinterpret_cast<std::byte*>(scratch.data()) + scratch_offsets[i]));
+        build_range_pointers.push_back(&build_ranges[i]);
+    }
+
+    // The driver splits the build in tasks, every worker joins the operation until there is nothing left to do
+    const vk::DeferredOperationKHR operation = context.device.createDeferredOperationKHR();
+    const auto start = std::chrono::steady_clock::now();
+    const vk::Result build_result = context.device.buildAccelerationStructuresKHR(operation, geometry_infos, build_range_pointers);
+    if (build_result == vk::Result::eOperationDeferredKHR) {
+        const uint32_t worker_count =
+            std::clamp(context.device.getDeferredOperationMaxConcurrencyKHR(operation), 1u, std::max(std::thread::hardware_concurrency(), 1u));
+        std::vector<std::jthread> workers;
+        workers.reserve(worker_count);
+        for (uint32_t i = 0u; i < worker_count; i++) {
+            workers.emplace_back([&context, operation]() {
+                while (context.device.deferredOperationJoinKHR(operation) == vk::Result::eThreadIdleKHR) {
+                    std::this_thread::yield();
+                }
+            });
+        }
+        workers.clear();
+        const vk::Result result = context.device.getDeferredOperationResultKHR(operation);
+        context.device.destroyDeferredOperationKHR(operation);
+        if (result != vk::Result::eSuccess)
+            throw std::runtime_error("Host acceleration structure build failed.");
+        spdlog::debug("Built {} BLAS on {} host threads.", blas.size(), worker_count);
+    } else {
+        context.device.destroyDeferredOperationKHR(operation);
+    }
+    spdlog::info(
+        "Host BLAS build took {} ms.", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()
+    );
+
+    // The compacted sizes are ready right away on the host, the copies move the BLAS to device local memory
+    std::vector<vk::AccelerationStructureKHR> acceleration_structures;
+    acceleration_structures.reserve(blas.size());
+    for (const auto& b : blas) {
+        acceleration_structures.push_back(b.acceleration_structure);
+    }
+    const auto compacted_sizes = context.device.writeAccelerationStructuresPropertiesKHR<vk::DeviceSize>(
+        acceleration_structures, vk::QueryType::eAccelerationStructureCompactedSizeKHR, acceleration_structures.size() * sizeof(vk::DeviceSize),
+        sizeof(vk::DeviceSize)
+    );
+    copy_compacted(context, blas, compacted_sizes, upload_batch);
+    return blas;
+}
+
+Blas_compaction::Blas_compaction(Context& context, const std::vector<Blas>& blas, vk::CommandBuffer command_buffer):
+    device(context.device) {
+    if (blas.empty())
+        return;
+    const auto query_count = static_cast<uint32_t>(blas.size());
+    query_pool = device.createQueryPool(vk::QueryPoolCreateInfo{.queryType = vk::QueryType::eAccelerationStructureCompactedSizeKHR, .queryCount = query_count});
+    command_buffer.resetQueryPool(query_pool, 0u, query_count);
+
+    const vk::MemoryBarrier2 memory_barrier{
+        .srcStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+        .srcAccessMask = vk::AccessFlagBits2::eAccelerationStructureWriteKHR,
+        .dstStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+        .dstAccessMask = vk::AccessFlagBits2::eAccelerationStructureReadKHR
     };
+    command_buffer.pipelineBarrier2(vk::DependencyInfo{.memoryBarrierCount = 1, .pMemoryBarriers = &memory_barrier});
 
-    const vk::AccelerationStructureBuildSizesInfoKHR build_size =
-        device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, geometry_info, 1u);
-    create_buffers(context, build_size);
-
-    acceleration_structure = device.createAccelerationStructureKHR(vk::AccelerationStructureCreateInfoKHR{
-        .createFlags = {},
-        .buffer = buffer.buffer,
-        .offset = 0u,
-        .size = build_size.accelerationStructureSize,
-        .type = vk::AccelerationStructureTypeKHR::eBottomLevel
-    });
-    address = device.getAccelerationStructureAddressKHR(vk::AccelerationStructureDeviceAddressInfoKHR{.accelerationStructure = acceleration_structure});
+    std::vector<vk::AccelerationStructureKHR> acceleration_structures;
+    acceleration_structures.reserve(blas.size());
+    for (const auto& b : blas) {
+        acceleration_structures.push_back(b.acceleration_structure);
+    }
+    command_buffer.writeAccelerationStructuresPropertiesKHR(acceleration_structures, vk::QueryType::eAccelerationStructureCompactedSizeKHR, query_pool, 0u);
+}
 
-    geometry_info.dstAccelerationStructure = acceleration_structure;
-    geometry_info.scratchData = vk::DeviceOrHostAddressKHR(scratch_address);
+Blas_compaction::~Blas_compaction() { device.destroyQueryPool(query_pool); }
 
-    const vk::AccelerationStructureBuildRangeInfoKHR build_range{.primitiveCount = 1u, .primitiveOffset = 0u, .firstVertex = 0u, .transformOffset = 0u};
-    {
-        One_time_command_buffer command_buffer(context.device, context.command_pool, context.queue);
-        command_buffer.command_buffer.buildAccelerationStructuresKHR(geometry_info, &build_range);
+void Blas_compaction::compact(Context& context, std::vector<Blas>& blas, Upload_batch& upload_batch) {
+    if (blas.empty())
+        return;
+    const auto query_count = static_cast<uint32_t>(blas.size());
+    const auto [result, compacted_sizes] = device.getQueryPoolResults<vk::DeviceSize>(
+        query_pool, 0u, query_count, query_count * sizeof(vk::DeviceSize), sizeof(vk::DeviceSize),
+        vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait
+    );
+    if (result != vk::Result::eSuccess) {
+        spdlog::warn("Could not read BLAS compacted sizes, skipping compaction.");
+        return;
     }
+
+    copy_compacted(context, blas, compacted_sizes, upload_batch);
 }
 
-Tlas::Tlas(Context& context, const std::vector<Blas>& blas, Scene& scene):
-    Acceleration_structure(context)
+Tlas::Tlas(Context& context, const std::vector<Blas>& blas, Scene& scene, vk::CommandBuffer command_buffer, Tlas_rebuild_policy rebuild_policy):
+    Acceleration_structure(context),
+    policy(rebuild_policy)
     {
     blas_addresses.reserve(blas.size());
+    blas_first_aabbs.reserve(blas.size());
     for (const auto& b : blas) {
         blas_addresses.push_back(b.address);
+        blas_first_aabbs.push_back(b.first_aabb);
+    }
+    model_visibilities.reserve(scene.models.size());
+    model_radii.reserve(scene.models.size());
+    for (const auto& model : scene.models) {
+        model_visibilities.push_back(model.visibility);
+        model_radii.push_back(0.5f * glm::distance(model.bounding_box[0], model.bounding_box[1]));
+        model_bounds[0].push_back(0.5f * (model.bounding_box[0] + model.bounding_box[1]));
+        model_bounds[1].push_back(0.5f * (model.bounding_box[1] - model.bounding_box[0]));
     }
+    build_flags = vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate |
+                  (policy.prefer_fast_build ? vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild
+                                            : vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace);
 
 
     instance_buffer = Vma_buffer(
@@ -205,6 +524,14 @@ Tlas::Tlas(Context& context, const std::vector<Blas>& blas, Scene& scene):
 
     const vk::DeviceAddress instance_buffer_address = device.getBufferAddress(vk::BufferDeviceAddressInfo{.buffer = instance_buffer.buffer});
 
+    ambient_occlusion_flags = Vma_buffer(
+        context.device, context.allocator,
+        vk::BufferCreateInfo{.size = sizeof(uint32_t) * Scene::max_entities, .usage = vk::BufferUsageFlagBits::eStorageBuffer},
+        VmaAllocationCreateInfo{
+            .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, .usage = VMA_MEMORY_USAGE_AUTO
+        }
+    );
+
     vk::AccelerationStructureGeometryDataKHR geometry_data{};
     geometry_data.setInstances(
         vk::AccelerationStructureGeometryInstancesDataKHR{.arrayOfPointers = false, .data = vk::DeviceOrHostAddressConstKHR(instance_buffer_address)}
@@ -214,59 +541,90 @@ Tlas::Tlas(Context& context, const std::vector<Blas>& blas, Scene& scene):
 
     const vk::AccelerationStructureBuildGeometryInfoKHR geometry_info{
         .type = vk::AccelerationStructureTypeKHR::eTopLevel,
-        .flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate,
+        .flags = build_flags,
         .geometryCount = 1u,
         .pGeometries = &acceleration_structure_geometry
     };
     const vk::AccelerationStructureBuildSizesInfoKHR build_size =
         device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, geometry_info, Scene::max_entities);
-    create_buffers(context, build_size);
-
-    acceleration_structure = device.createAccelerationStructureKHR(vk::AccelerationStructureCreateInfoKHR{
-        .createFlags = {},
-        .buffer = buffer.buffer,
-        .offset = 0u,
-        .size = build_size.accelerationStructureSize,
-        .type = vk::AccelerationStructureTypeKHR::eTopLevel
-    });
+    create(context, vk::AccelerationStructureTypeKHR::eTopLevel, build_size.accelerationStructureSize);
+    scratch_buffer = Vma_buffer(
+        device, context.allocator,
+        vk::BufferCreateInfo{
+            .size = std::max(build_size.buildScratchSize, build_size.updateScratchSize),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            .sharingMode = vk::SharingMode::eExclusive
+        },
+        VmaAllocationCreateInfo{.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE}
+    );
+    scratch_address = device.getBufferAddress(vk::BufferDeviceAddressInfo{.buffer = scratch_buffer.buffer});
 
-    {
-        One_time_command_buffer command_buffer(context.device, context.command_pool, context.queue);
-        update(command_buffer.command_buffer, true, scene);
-    }
+    update(command_buffer, true, scene);
 }
 
 void Tlas::update(vk::CommandBuffer command_buffer, bool first_build, const Scene& scene) {
-    std::vector<vk::AccelerationStructureInstanceKHR> entities_instances{};
-    for (const auto& entity : scene.entities) {
-        glm::mat4 transform = glm::translate(entity.global_transform.position) * glm::toMat4(entity.global_transform.rotation) *
-                              glm::scale(glm::vec3(entity.global_transform.scale));
-        entities_instances.push_back(vk::AccelerationStructureInstanceKHR{
-            .transform =
-                {.matrix =
-                     std::array<std::array<float, 4>, 3>{
-                         std::array<float, 4>{transform[0][0], transform[1][0], transform[2][0], transform[3][0]},
-                         std::array<float, 4>{transform[0][1], transform[1][1], transform[2][1], transform[3][1]},
-                         std::array<float, 4>{transform[0][2], transform[1][2], transform[2][2], transform[3][2]}
-                     }},
-            .instanceCustomIndex = 0,
-            .mask = 0xFF,
-            .instanceShaderBindingTableRecordOffset = static_cast<uint32_t>(3 * entity.model_index),
-            .accelerationStructureReference = blas_addresses[entity.model_index]
+    bool rebuild = first_build || scene.entities.size() != built_transforms.size();
+    if (!rebuild) {
+        // Static instances are never written again, without any dynamic one moving the TLAS is still up to date
+        const bool moved = std::ranges::any_of(instance_order | std::views::drop(static_count), [&](size_t entity_index) {
+            return scene.entities[entity_index].global_transform != written_transforms[entity_index];
         });
+        if (!moved) {
+            statistics.skipped++;
+            return;
+        }
+        statistics.displacement_since_build = displacement(scene);
+        rebuild = statistics.refits_since_build >= policy.max_refits || statistics.displacement_since_build >= policy.max_displacement;
+        if (rebuild) {
+            spdlog::debug("Rebuilding TLAS after {} refits, displacement {:.2f}.", statistics.refits_since_build, statistics.displacement_since_build);
+        }
+    }
+    if (rebuild) {
+        instance_order.clear();
+        built_transforms.clear();
+        for (size_t i = 0u; i < scene.entities.size(); i++) {
+            if (scene.entities[i].mobility == Mobility::Static)
+                instance_order.push_back(i);
+            built_transforms.push_back(scene.entities[i].global_transform);
+        }
+        static_count = instance_order.size();
+        for (size_t i = 0u; i < scene.entities.size(); i++) {
+            if (scene.entities[i].mobility == Mobility::Dynamic)
+                instance_order.push_back(i);
+        }
+        written_transforms = built_transforms;
+        statistics.builds++;
+        statistics.refits_since_build = 0u;
+        statistics.displacement_since_build = 0.0f;
+    } else {
+        statistics.refits++;
+        statistics.refits_since_build++;
     }
-    instance_buffer.copy(reinterpret_cast<const void*>(entities_instances.data()), entities_instances.size() * sizeof(vk::AccelerationStructureInstanceKHR));
-    instance_buffer.flush();
+
+    // Instances are ordered static first, refits only rewrite the dynamic range
+    const size_t first_written = rebuild ? 0u : static_count;
+    std::vector<vk::AccelerationStructureInstanceKHR> entities_instances{};
+    entities_instances.reserve(instance_order.size() - first_written);
+    for (size_t i = first_written; i < instance_order.size(); i++) {
+        const Entity& entity = scene.entities[instance_order[i]];
+        written_transforms[instance_order[i]] = entity.global_transform;
+        entities_instances.push_back(instance(entity));
+    }
+    const size_t offset = first_written * sizeof(vk::AccelerationStructureInstanceKHR);
+    const size_t size = entities_instances.size() * sizeof(vk::AccelerationStructureInstanceKHR);
+    instance_buffer.copy(reinterpret_cast<const void*>(entities_instances.data()), size, offset);
+    instance_buffer.flush(offset, size);
+    write_ambient_occlusion_flags(scene);
 
     const vk::AccelerationStructureBuildRangeInfoKHR build_range{
-        .primitiveCount = static_cast<uint32_t>(scene.entities.size()), .primitiveOffset = 0u, .firstVertex = 0u, .transformOffset = 0u
+        .primitiveCount = static_cast<uint32_t>(instance_order.size()), .primitiveOffset = 0u, .firstVertex = 0u, .transformOffset = 0u
     };
     command_buffer.buildAccelerationStructuresKHR(
         vk::AccelerationStructureBuildGeometryInfoKHR{
             .type = vk::AccelerationStructureTypeKHR::eTopLevel,
-            .flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate,
-            .mode = first_build ? vk::BuildAccelerationStructureModeKHR::eBuild : vk::BuildAccelerationStructureModeKHR::eUpdate,
-            .srcAccelerationStructure = first_build ? nullptr : acceleration_structure,
+            .flags = build_flags,
+            .mode = rebuild ? vk::BuildAccelerationStructureModeKHR::eBuild : vk::BuildAccelerationStructureModeKHR::eUpdate,
+            .srcAccelerationStructure = rebuild ? nullptr : acceleration_structure,
             .dstAccelerationStructure = acceleration_structure,
             .geometryCount = 1,
             .pGeometries = &acceleration_structure_geometry,
@@ -276,4 +634,75 @@ void Tlas::update(vk::CommandBuffer command_buffer, bool first_build, const Scen
     );
 }
 
+vk::AccelerationStructureInstanceKHR Tlas::instance(const Entity& entity) const {
+    glm::mat4 transform = glm::translate(entity.global_transform.position) * glm::toMat4(entity.global_transform.rotation) *
+                          glm::scale(glm::vec3(entity.global_transform.scale));
+    return vk::AccelerationStructureInstanceKHR{
+        .transform =
+            {.matrix =
+                 std::array<std::array<float, 4>, 3>{
+                     std::array<float, 4>{transform[0][0], transform[1][0], transform[2][0], transform[3][0]},
+                     std::array<float, 4>{transform[0][1], transform[1][1], transform[2][1], transform[3][1]},
+                     std::array<float, 4>{transform[0][2], transform[1][2], transform[2][2], transform[3][2]}
+                 }},
+        .instanceCustomIndex = blas_first_aabbs[entity.model_index], // Shaders find the AABB of a primitive from there
+        .mask = visibility_mask(entity.visibility.value_or(model_visibilities[entity.model_index])),
+        .instanceShaderBindingTableRecordOffset = hit_groups_per_model * static_cast<uint32_t>(entity.model_index),
+        .accelerationStructureReference = blas_addresses[entity.model_index]
+    };
+}
+
+float Tlas::displacement(const Scene& scene) const {
+    float total = 0.0f;
+    for (const size_t i : instance_order | std::views::drop(static_count)) {
+        const Transform& current = scene.entities[i].global_transform;
+        const Transform& built = built_transforms[i];
+        const float model_radius = model_radii[scene.entities[i].model_index];
+        const float angle = 2.0f * std::acos(std::min(std::abs(glm::dot(current.rotation, built.rotation)), 1.0f));
+        total += glm::distance(current.position, built.position) + angle * model_radius * std::max(current.scale, built.scale) +
+                 std::abs(current.scale - built.scale) * model_radius;
+    }
+    return total;
+}
+
+void Tlas::write_ambient_occlusion_flags(const Scene& scene) {
+    // World bounding boxes of the instances, then sweep and prune along x
+    const size_t instance_count = instance_order.size();
+    std::vector<glm::vec3> centers(instance_count);
+    std::vector<glm::vec3> half_extents(instance_count);
+    std::vector<size_t> sorted(instance_count);
+    for (size_t i = 0u; i < instance_count; i++) {
+        const Entity& entity = scene.entities[instance_order[i]];
+        const Transform& transform = entity.global_transform;
+        const glm::mat3 rotation = glm::toMat3(transform.rotation);
+        centers[i] = transform.position + rotation * (transform.scale * model_bounds[0][entity.model_index]);
+        half_extents[i] = glm::mat3(glm::abs(rotation[0]), glm::abs(rotation[1]), glm::abs(rotation[2])) *
+                          (transform.scale * model_bounds[1][entity.model_index]);
+        sorted[i] = i;
+    }
+    std::ranges::sort(sorted, {}, [&](size_t i) { return centers[i].x - half_extents[i].x; });
+
+    std::vector<uint32_t> flags(instance_count, 0u);
+    const auto occludes_ambient = [&](size_t i) {
+        const Entity& entity = scene.entities[instance_order[i]];
+        return entity.visibility.value_or(model_visibilities[entity.model_index]).occludes_ambient;
+    };
+    for (size_t i = 0u; i < instance_count; i++) {
+        flags[i] = occludes_ambient(i) ? ambient_occluder_flag : 0u;
+    }
+    for (size_t a = 0u; a < instance_count; a++) {
+        const size_t i = sorted[a];
+        const float max_x = centers[i].x + half_extents[i].x + ambient_occlusion_reach;
+        for (size_t b = a + 1u; b < instance_count && centers[sorted[b]].x - half_extents[sorted[b]].x <= max_x; b++) {
+            const size_t j = sorted[b];
+            if (glm::any(glm::greaterThan(glm::abs(centers[i] - centers[j]), half_extents[i] + half_extents[j] + ambient_occlusion_reach)))
+                continue;
+            flags[i] |= (flags[j] & ambient_occluder_flag) ? ambient_overlap_flag : 0u;
+            flags[j] |= (flags[i] & ambient_occluder_flag) ? ambient_overlap_flag : 0u;
+        }
+    }
+    ambient_occlusion_flags.copy(flags.data(), flags.size() * sizeof(uint32_t));
+    ambient_occlusion_flags.flush();
+}
+
 }
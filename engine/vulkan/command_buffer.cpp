@@ -1,47 +1,45 @@
 module;
 #include <spdlog/spdlog.h>
 #include <vulkan/vulkan_hpp_macros.hpp>
+#include <vma_includes.hpp>
 export module tale.vulkan.command_buffer;
+import std;
 import vulkan_hpp;
 import tale.vulkan.context;
+import tale.vulkan.buffer;
 
 namespace tale::vulkan {
 
-export class One_time_command_buffer {
+// Record uploads and acceleration structure builds of many objects in one command buffer, submitted once on the context upload timeline
+export class Upload_batch {
 public:
     vk::CommandBuffer command_buffer;
 
-    One_time_command_buffer(vk::Device device, vk::CommandPool command_pool, vk::Queue queue):
-        device(device),
-        command_pool(command_pool),
-        queue(queue) {
-        std::vector<vk::CommandBuffer> command_buffers = device.allocateCommandBuffers(
-            vk::CommandBufferAllocateInfo{.commandPool = command_pool, .level = vk::CommandBufferLevel::ePrimary, .commandBufferCount = 1}
-        );
-        command_buffer = command_buffers.front();
-        command_buffer.begin(vk::CommandBufferBeginInfo{.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
-    }
-    One_time_command_buffer(const One_time_command_buffer& other) = delete;
-    One_time_command_buffer(One_time_command_buffer&& other) = delete;
-    One_time_command_buffer& operator=(const One_time_command_buffer& other) = default;
-    One_time_command_buffer& operator=(One_time_command_buffer&& other) = delete;
-
-    ~One_time_command_buffer() { submit_and_wait_idle(); }
-
-    void submit_and_wait_idle() {
-        if (device) {
-            command_buffer.end();
-            queue.submit(vk::SubmitInfo{.commandBufferCount = 1, .pCommandBuffers = &command_buffer}, {});
-            queue.waitIdle();
-            device.freeCommandBuffers(command_pool, command_buffer);
-            device = nullptr;
-        }
+    Upload_batch(Context& context);
+    Upload_batch(const Upload_batch& other) = delete;
+    Upload_batch(Upload_batch&& other) = delete;
+    Upload_batch& operator=(const Upload_batch& other) = delete;
+    Upload_batch& operator=(Upload_batch&& other) = delete;
+    ~Upload_batch() { wait(); }
+
+    // Create a device local buffer filled with data through the staging ring
+    [[nodiscard]] Vma_buffer upload(vk::BufferCreateInfo buffer_info, const void* data);
+
+    // Resources only needed by the recorded commands, destroyed once the batch is done
+    template <typename T>
+    void keep_alive(T&& resource) {
+        retired.push_back(std::make_shared<std::remove_cvref_t<T>>(std::forward<T>(resource)));
     }
 
-protected:
-    vk::Device device;
-    vk::CommandPool command_pool;
-    vk::Queue queue;
+    // Return the upload timeline value signaled when the batch is done
+    uint64_t submit();
+    [[nodiscard]] bool is_complete() const;
+    void wait();
+
+private:
+    Context& context;
+    uint64_t timeline_value = 0u;
+    std::vector<std::shared_ptr<void>> retired;
 };
 
 export class Reusable_command_pools {
@@ -96,4 +94,88 @@ public:
 
     void wait_until_done() { [[maybe_unused]] auto result = device.waitForFences(fences, true, std::numeric_limits<uint64_t>::max()); }
 };
-}
\ No newline at end of file
+}
+
+module :private;
+
+namespace tale::vulkan {
+
+static constexpr vk::DeviceSize staging_alignment = 16u;
+
+Upload_batch::Upload_batch(Context& context):
+    context(context) {
+    command_buffer = context.device
+                         .allocateCommandBuffers(vk::CommandBufferAllocateInfo{
+                             .commandPool = context.command_pool, .level = vk::CommandBufferLevel::ePrimary, .commandBufferCount = 1
+                         })
+                         .front();
+    command_buffer.begin(vk::CommandBufferBeginInfo{.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+}
+
+Vma_buffer Upload_batch::upload(vk::BufferCreateInfo buffer_info, const void* data) {
+    context.staging_ring.reclaim(context.device.getSemaphoreCounterValue(context.upload_timeline));
+    if (const auto offset = context.staging_ring.push(this, data, buffer_info.size, staging_alignment)) {
+        buffer_info.usage |= vk::BufferUsageFlagBits::eTransferDst;
+        Vma_buffer result(context.device, context.allocator, buffer_info, VmaAllocationCreateInfo{.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE});
+        command_buffer.copyBuffer(
+            context.staging_ring.staging.buffer, result.buffer, vk::BufferCopy{.srcOffset = *offset, .dstOffset = 0, .size = buffer_info.size}
+        );
+        return result;
+    }
+    // Too big for what's left in the ring, use a dedicated staging buffer
+    spdlog::debug("Staging ring full, allocating a staging buffer of {} bytes.", buffer_info.size);
+    Buffer_from_staged buffer_and_staged(context.device, context.allocator, command_buffer, buffer_info, data);
+    keep_alive(std::move(buffer_and_staged.staging));
+    return std::move(buffer_and_staged.result);
+}
+
+uint64_t Upload_batch::submit() {
+    if (timeline_value != 0u)
+        return timeline_value;
+
+    // Make the batch writes available to anything submitted after it
+    const vk::MemoryBarrier2 memory_barrier{
+        .srcStageMask = vk::PipelineStageFlagBits2::eAllCommands,
+        .srcAccessMask = vk::AccessFlagBits2::eMemoryWrite,
+        .dstStageMask = vk::PipelineStageFlagBits2::eAllCommands,
+        .dstAccessMask = vk::AccessFlagBits2::eMemoryRead | vk::AccessFlagBits2::eMemoryWrite
+    };
+    command_buffer.pipelineBarrier2(vk::DependencyInfo{.memoryBarrierCount = 1, .pMemoryBarriers = &memory_barrier});
+    command_buffer.end();
+
+    timeline_value = ++context.upload_timeline_value;
+    context.staging_ring.close(this, timeline_value);
+
+    const vk::CommandBufferSubmitInfo command_buffer_submit_info{.commandBuffer = command_buffer};
+    const vk::SemaphoreSubmitInfo signal_semaphore_submit_info{
+        .semaphore = context.upload_timeline, .value = timeline_value, .stageMask = vk::PipelineStageFlagBits2::eAllCommands
+    };
+    context.queue.submit2(
+        vk::SubmitInfo2{
+            .commandBufferInfoCount = 1,
+            .pCommandBufferInfos = &command_buffer_submit_info,
+            .signalSemaphoreInfoCount = 1,
+            .pSignalSemaphoreInfos = &signal_semaphore_submit_info
+        },
+        {}
+    );
+    return timeline_value;
+}
+
+bool Upload_batch::is_complete() const {
+    return timeline_value != 0u && context.device.getSemaphoreCounterValue(context.upload_timeline) >= timeline_value;
+}
+
+void Upload_batch::wait() {
+    if (!command_buffer)
+        return;
+    submit();
+    [[maybe_unused]] auto result = context.device.waitSemaphores(
+        vk::SemaphoreWaitInfo{.semaphoreCount = 1, .pSemaphores = &context.upload_timeline, .pValues = &timeline_value}, std::numeric_limits<uint64_t>::max()
+    );
+    context.device.freeCommandBuffers(context.command_pool, command_buffer);
+    command_buffer = nullptr;
+    retired.clear();
+    context.staging_ring.reclaim(timeline_value);
+}
+}
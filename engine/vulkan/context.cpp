@@ -6,8 +6,12 @@ import std;
 import vulkan_hpp;
 import tale.window;
 import tale.vr.instance;
+import tale.vulkan.buffer;
 
 namespace tale::vulkan {
+// Distance field textures per descriptor set, sizes the combined image samplers of the descriptor pool
+export constexpr uint32_t max_distance_fields = 8u;
+
 export class Context {
 public:
     vk::Instance instance;
@@ -19,6 +23,12 @@ public:
     vk::Queue queue;
     VmaAllocator allocator;
     vk::DescriptorPool descriptor_pool;
+    // Uploads are signaled on this timeline, see Upload_batch
+    vk::Semaphore upload_timeline;
+    uint64_t upload_timeline_value = 0u;
+    Staging_ring staging_ring;
+    // Acceleration structures can be built on the CPU, see build_blas_on_host
+    bool acceleration_structure_host_commands = false;
 
     Context(Window& window, vr::Instance* vr_instance = nullptr);
     Context(const Context& other) = delete;
@@ -39,6 +49,7 @@ private:
 module :private;
 
 constexpr bool use_validation_layers = true;
+constexpr vk::DeviceSize staging_ring_size = 16u * 1024u * 1024u;
 
 namespace tale::vulkan {
 
@@ -51,8 +62,10 @@ Context::Context(Window& window, vr::Instance* vr_instance) {
 }
 
 Context::~Context() {
+    staging_ring.staging.free();
     vmaDestroyAllocator(allocator);
     device.destroyDescriptorPool(descriptor_pool);
+    device.destroySemaphore(upload_timeline);
     device.destroyCommandPool(command_pool);
     device.destroy();
     instance.destroySurfaceKHR(surface);
@@ -161,7 +174,8 @@ void Context::init_device(vr::Instance* vr_instance) {
                 continue;
             if (!sync_features.synchronization2)
                 continue;
-            if (!vulkan_12_features.bufferDeviceAddress || !vulkan_12_features.uniformBufferStandardLayout || !vulkan_12_features.scalarBlockLayout /*||
+            if (!vulkan_12_features.bufferDeviceAddress || !vulkan_12_features.uniformBufferStandardLayout || !vulkan_12_features.scalarBlockLayout ||
+                !vulkan_12_features.timelineSemaphore /*||
                 !vulkan_12_features.uniformAndStorageBuffer8BitAccess*/)
                 continue;
         }
@@ -186,15 +200,24 @@ void Context::init_device(vr::Instance* vr_instance) {
         for (const auto& property : available_extensions) {
             spdlog::debug("\t{}", std::string_view(property.extensionName));
         }
+
+        vk::PhysicalDeviceAccelerationStructureFeaturesKHR as_features{};
+        vk::PhysicalDeviceFeatures2 features{.pNext = &as_features};
+        physical_device.getFeatures2(&features);
+        acceleration_structure_host_commands = as_features.accelerationStructureHostCommands;
+        spdlog::info("Host acceleration structure commands {}.", acceleration_structure_host_commands ? "supported" : "not supported");
     }
 
     vk::PhysicalDeviceVulkan12Features vulkan_12_features{
         .scalarBlockLayout = true,
         .uniformBufferStandardLayout = true,
+        .timelineSemaphore = true,
         .bufferDeviceAddress = true,
     };
     vk::PhysicalDeviceSynchronization2FeaturesKHR sync_features{.pNext = &vulkan_12_features, .synchronization2 = true};
-    vk::PhysicalDeviceAccelerationStructureFeaturesKHR raytracing_as_features{.pNext = &sync_features, .accelerationStructure = true};
+    vk::PhysicalDeviceAccelerationStructureFeaturesKHR raytracing_as_features{
+        .pNext = &sync_features, .accelerationStructure = true, .accelerationStructureHostCommands = acceleration_structure_host_commands
+    };
     vk::PhysicalDeviceRayTracingPipelineFeaturesKHR raytracing_pileline_features{
         .pNext = &raytracing_as_features,
         .rayTracingPipeline = true,
@@ -227,6 +250,8 @@ void Context::init_device(vr::Instance* vr_instance) {
     queue = device.getQueue(queue_family, 0u);
     command_pool =
         device.createCommandPool(vk::CommandPoolCreateInfo{.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer, .queueFamilyIndex = queue_family});
+    const vk::SemaphoreTypeCreateInfo timeline_info{.semaphoreType = vk::SemaphoreType::eTimeline, .initialValue = upload_timeline_value};
+    upload_timeline = device.createSemaphore(vk::SemaphoreCreateInfo{.pNext = &timeline_info});
 }
 
 void Context::init_allocator() {
@@ -264,14 +289,17 @@ void Context::init_allocator() {
         .instance = instance
     };
     vmaCreateAllocator(&allocator_info, &allocator);
+    staging_ring = Staging_ring(device, allocator, staging_ring_size);
 }
 
 void Context::init_descriptor_pool() {
     constexpr uint32_t max_frames_in_flight = 10u;
     std::array pool_sizes{
         vk::DescriptorPoolSize{.type = vk::DescriptorType::eUniformBuffer, .descriptorCount = max_frames_in_flight},
-        vk::DescriptorPoolSize{.type = vk::DescriptorType::eCombinedImageSampler, .descriptorCount = max_frames_in_flight},
-        vk::DescriptorPoolSize{.type = vk::DescriptorType::eStorageBuffer, .descriptorCount = max_frames_in_flight * 4}
+        vk::DescriptorPoolSize{.type = vk::DescriptorType::eCombinedImageSampler, .descriptorCount = max_frames_in_flight * max_distance_fields},
+        vk::DescriptorPoolSize{.type = vk::DescriptorType::eStorageBuffer, .descriptorCount = max_frames_in_flight * 8},
+        vk::DescriptorPoolSize{.type = vk::DescriptorType::eStorageImage, .descriptorCount = max_frames_in_flight * 4},
+        vk::DescriptorPoolSize{.type = vk::DescriptorType::eAccelerationStructureKHR, .descriptorCount = max_frames_in_flight}
     };
     descriptor_pool = device.createDescriptorPool(vk::DescriptorPoolCreateInfo{
         .maxSets = max_frames_in_flight, .poolSizeCount = static_cast<uint32_t>(pool_sizes.size()), .pPoolSizes = pool_sizes.data()
@@ -0,0 +1,229 @@
+module;
+#include <glm/glm.hpp>
+#include <vma_includes.hpp>
+export module tale.vulkan.distance_field;
+import std;
+import vulkan_hpp;
+import tale.scene;
+import tale.vulkan.context;
+import tale.vulkan.command_buffer;
+import tale.vulkan.image;
+
+namespace tale::vulkan {
+
+// Distance and material id of a model on a grid over its bounding box, sampled by distance_field.glsl
+export class Distance_field {
+public:
+    Vma_image image;
+    vk::ImageView image_view;
+
+    Distance_field(Context& context, uint32_t resolution);
+    Distance_field(const Distance_field& other) = delete;
+    Distance_field(Distance_field&& other) noexcept;
+    Distance_field& operator=(const Distance_field& other) = delete;
+    Distance_field& operator=(Distance_field&& other) noexcept;
+    ~Distance_field();
+
+private:
+    vk::Device device;
+};
+
+// Distance fields filled by a submitted batch, the queue runs the bake before the frames submitted after it
+export struct Distance_field_bake {
+    std::vector<Distance_field> distance_fields;
+    std::unique_ptr<Upload_batch> batch; // Null when no model has a baked distance field, waits for the bake when destroyed
+};
+
+// Evaluate the map of the models with a Baked_distance_field in compute shaders, in model order like DISTANCE_FIELD_INDEX
+// Returns once the bake is submitted, without waiting for it
+export [[nodiscard]] Distance_field_bake bake_distance_fields(Context& context, const Scene& scene);
+}
+
+module :private;
+
+namespace tale::vulkan {
+
+constexpr vk::Format distance_field_format = vk::Format::eR16G16Sfloat;
+constexpr uint32_t bake_group_size = 4u; // Local size of bake_distance_field.comp
+
+// Objects of the bake pipelines, kept alive by the batch until the bake is done
+struct Bake_resources {
+    vk::Device device;
+    vk::DescriptorSetLayout descriptor_set_layout;
+    vk::PipelineLayout pipeline_layout;
+    vk::DescriptorPool descriptor_pool;
+    std::vector<vk::Pipeline> pipelines;
+
+    explicit Bake_resources(vk::Device device):
+        device(device) {}
+    Bake_resources(const Bake_resources& other) = delete;
+    Bake_resources(Bake_resources&& other) noexcept:
+        device(std::exchange(other.device, nullptr)),
+        descriptor_set_layout(other.descriptor_set_layout),
+        pipeline_layout(other.pipeline_layout),
+        descriptor_pool(other.descriptor_pool),
+        pipelines(std::move(other.pipelines)) {}
+    Bake_resources& operator=(const Bake_resources& other) = delete;
+    Bake_resources& operator=(Bake_resources&& other) = delete;
+    ~Bake_resources() {
+        if (!device)
+            return;
+        for (const vk::Pipeline pipeline : pipelines) {
+            device.destroyPipeline(pipeline);
+        }
+        device.destroyDescriptorPool(descriptor_pool);
+        device.destroyPipelineLayout(pipeline_layout);
+        device.destroyDescriptorSetLayout(descriptor_set_layout);
+    }
+};
+
+Distance_field::Distance_field(Context& context, uint32_t resolution):
+    image(
+        context.device, context.allocator,
+        vk::ImageCreateInfo{
+            .imageType = vk::ImageType::e3D,
+            .format = distance_field_format,
+            .extent = {resolution, resolution, resolution},
+            .mipLevels = 1u,
+            .arrayLayers = 1u,
+            .samples = vk::SampleCountFlagBits::e1,
+            .tiling = vk::ImageTiling::eOptimal,
+            .usage = vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eSampled,
+            .sharingMode = vk::SharingMode::eExclusive,
+            .initialLayout = vk::ImageLayout::eUndefined
+        },
+        VmaAllocationCreateInfo{.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE}
+    ),
+    device(context.device) {
+    image_view = device.createImageView(vk::ImageViewCreateInfo{
+        .image = image.image,
+        .viewType = vk::ImageViewType::e3D,
+        .format = distance_field_format,
+        .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor, .baseMipLevel = 0u, .levelCount = 1u, .baseArrayLayer = 0u, .layerCount = 1u}
+    });
+}
+
+Distance_field::Distance_field(Distance_field&& other) noexcept:
+    image(std::move(other.image)),
+    image_view(other.image_view),
+    device(other.device) {
+    other.device = nullptr;
+}
+
+Distance_field& Distance_field::operator=(Distance_field&& other) noexcept {
+    image = std::move(other.image);
+    std::swap(image_view, other.image_view);
+    std::swap(device, other.device);
+    return *this;
+}
+
+Distance_field::~Distance_field() {
+    if (device) {
+        device.destroyImageView(image_view);
+        device = nullptr;
+    }
+}
+
+Distance_field_bake bake_distance_fields(Context& context, const Scene& scene) {
+    Distance_field_bake bake;
+    auto baked_models = scene.models | std::views::filter([](const Model& model) { return model.baked_distance_field.has_value(); });
+    const auto count = static_cast<size_t>(std::ranges::distance(baked_models));
+    if (count == 0) {
+        return bake;
+    }
+    if (count > max_distance_fields) {
+        throw std::runtime_error("Too many models with a baked distance field.");
+    }
+    std::vector<Distance_field>& distance_fields = bake.distance_fields;
+    distance_fields.reserve(count);
+
+    const vk::Device device = context.device;
+    Bake_resources resources(device);
+    const vk::DescriptorSetLayoutBinding binding{
+        .binding = 0u, .descriptorType = vk::DescriptorType::eStorageImage, .descriptorCount = 1u, .stageFlags = vk::ShaderStageFlagBits::eCompute
+    };
+    const vk::DescriptorSetLayout descriptor_set_layout = resources.descriptor_set_layout =
+        device.createDescriptorSetLayout(vk::DescriptorSetLayoutCreateInfo{.bindingCount = 1u, .pBindings = &binding});
+    const vk::PushConstantRange push_constants{.stageFlags = vk::ShaderStageFlagBits::eCompute, .offset = 0, .size = sizeof(std::array<glm::vec3, 2>)};
+    const vk::PipelineLayout pipeline_layout = resources.pipeline_layout = device.createPipelineLayout(vk::PipelineLayoutCreateInfo{
+        .setLayoutCount = 1u, .pSetLayouts = &descriptor_set_layout, .pushConstantRangeCount = 1u, .pPushConstantRanges = &push_constants
+    });
+    const vk::DescriptorPoolSize pool_size{.type = vk::DescriptorType::eStorageImage, .descriptorCount = static_cast<uint32_t>(count)};
+    const vk::DescriptorPool descriptor_pool = resources.descriptor_pool = device.createDescriptorPool(
+        vk::DescriptorPoolCreateInfo{.maxSets = static_cast<uint32_t>(count), .poolSizeCount = 1u, .pPoolSizes = &pool_size}
+    );
+    std::vector<vk::Pipeline>& pipelines = resources.pipelines;
+    pipelines.reserve(count);
+
+    bake.batch = std::make_unique<Upload_batch>(context);
+    const vk::CommandBuffer command_buffer = bake.batch->command_buffer;
+    for (const Model& model : baked_models) {
+        const uint32_t resolution = model.baked_distance_field->resolution;
+        const Distance_field& distance_field = distance_fields.emplace_back(context, resolution);
+
+        const vk::DescriptorSet descriptor_set = device
+                                                     .allocateDescriptorSets(vk::DescriptorSetAllocateInfo{
+                                                         .descriptorPool = descriptor_pool, .descriptorSetCount = 1u, .pSetLayouts = &descriptor_set_layout
+                                                     })
+                                                     .front();
+        const vk::DescriptorImageInfo image_info{.imageView = distance_field.image_view, .imageLayout = vk::ImageLayout::eGeneral};
+        device.updateDescriptorSets(
+            vk::WriteDescriptorSet{
+                .dstSet = descriptor_set,
+                .dstBinding = 0,
+                .dstArrayElement = 0,
+                .descriptorCount = 1,
+                .descriptorType = vk::DescriptorType::eStorageImage,
+                .pImageInfo = &image_info
+            },
+            {}
+        );
+        pipelines.push_back(device
+                                .createComputePipeline(
+                                    nullptr,
+                                    vk::ComputePipelineCreateInfo{
+                                        .stage =
+                                            {.stage = vk::ShaderStageFlagBits::eCompute, .module = model.shaders.bake_distance_field.module, .pName = "main"},
+                                        .layout = pipeline_layout
+                                    }
+                                )
+                                .value);
+
+        const vk::ImageSubresourceRange subresource_range{
+            .aspectMask = vk::ImageAspectFlagBits::eColor, .baseMipLevel = 0, .levelCount = 1u, .baseArrayLayer = 0, .layerCount = 1
+        };
+        const vk::ImageMemoryBarrier2 to_general{
+            .srcStageMask = vk::PipelineStageFlagBits2::eTopOfPipe,
+            .srcAccessMask = {},
+            .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+            .dstAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .oldLayout = vk::ImageLayout::eUndefined,
+            .newLayout = vk::ImageLayout::eGeneral,
+            .image = distance_field.image.image,
+            .subresourceRange = subresource_range
+        };
+        command_buffer.pipelineBarrier2(vk::DependencyInfo{.imageMemoryBarrierCount = 1, .pImageMemoryBarriers = &to_general});
+
+        command_buffer.bindPipeline(vk::PipelineBindPoint::eCompute, pipelines.back());
+        command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, pipeline_layout, 0, descriptor_set, {});
+        command_buffer.pushConstants(pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(model.bounding_box), model.bounding_box.data());
+        const uint32_t group_count = (resolution + bake_group_size - 1u) / bake_group_size;
+        command_buffer.dispatch(group_count, group_count, group_count);
+
+        const vk::ImageMemoryBarrier2 to_sampled{
+            .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+            .dstAccessMask = vk::AccessFlagBits2::eShaderSampledRead,
+            .oldLayout = vk::ImageLayout::eGeneral,
+            .newLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+            .image = distance_field.image.image,
+            .subresourceRange = subresource_range
+        };
+        command_buffer.pipelineBarrier2(vk::DependencyInfo{.imageMemoryBarrierCount = 1, .pImageMemoryBarriers = &to_sampled});
+    }
+    bake.batch->keep_alive(std::move(resources));
+    bake.batch->submit();
+    return bake;
+}
+}
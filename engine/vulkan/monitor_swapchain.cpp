@@ -1,4 +1,5 @@
 module;
+#include <spdlog/spdlog.h>
 #include <vma_includes.hpp>
 export module tale.vulkan.monitor_swapchain;
 import std;
@@ -10,14 +11,18 @@ namespace tale::vulkan {
 export class Monitor_swapchain {
 public:
     static constexpr vk::Format format{vk::Format::eB8G8R8A8Unorm};
-    // static constexpr vk::Format format{vk::Format::eB8G8R8A8Srgb};
+    static constexpr vk::Format srgb_format{vk::Format::eB8G8R8A8Srgb}; // Blits decode srgb sources, the destination has to encode again
+    static constexpr vk::Format storage_format{vk::Format::eR8G8B8A8Unorm}; // Bgra has no shader format qualifier
     static constexpr uint32_t image_count{3u};
 
     vk::SwapchainKHR swapchain;
     vk::Extent2D extent;
     std::array<vk::Image, image_count> images;
+    bool storage_images = false; // The surface allows storage usage, the images can be traced into through storage_image_views
+    std::array<vk::ImageView, image_count> storage_image_views;
 
-    Monitor_swapchain(Context& context, size_t size_command_buffers);
+    // With srgb_sources, the images are only copied to from srgb images, e.g. the XR swapchain images
+    Monitor_swapchain(Context& context, size_t size_command_buffers, bool srgb_sources = false);
     Monitor_swapchain(const Monitor_swapchain& other) = delete;
     Monitor_swapchain(Monitor_swapchain&& other) = delete;
     Monitor_swapchain& operator=(const Monitor_swapchain& other) = default;
@@ -25,6 +30,8 @@ public:
     ~Monitor_swapchain();
 
     void copy_image(vk::CommandBuffer command_buffer, vk::Image source_image, size_t command_pool_id, vk::Extent2D source_extent);
+    // The returned image is traced into instead of copied to, it has to be in general layout before present
+    uint32_t acquire_storage_image(size_t command_pool_id);
     void present(vk::CommandBuffer& command_buffer, vk::Fence fence, size_t command_pool_id);
 
 private:
@@ -33,7 +40,9 @@ private:
     std::vector<vk::Semaphore> semaphore_available;
     std::vector<vk::Semaphore> semaphore_finished;
     uint32_t next_image_id{};
+    bool next_image_traced = false;
 
+    void acquire_image(size_t command_pool_id);
     void create_synchronization(size_t size_command_buffers);
 };
 }
@@ -41,20 +50,37 @@ private:
 module :private;
 
 namespace tale::vulkan {
-Monitor_swapchain::Monitor_swapchain(Context& context, size_t size_command_buffers):
+
+// Trace into the swapchain images when the surface allows it, removes the blit of full resolution frames
+constexpr bool use_storage_images = true;
+
+Monitor_swapchain::Monitor_swapchain(Context& context, size_t size_command_buffers, bool srgb_sources):
     device(context.device),
     queue(context.queue) {
     constexpr vk::ColorSpaceKHR colorspace{vk::ColorSpaceKHR::eSrgbNonlinear};
     constexpr vk::PresentModeKHR present_mode{vk::PresentModeKHR::eFifo};
 
     const auto available_formats = context.physical_device.getSurfaceFormatsKHR(context.surface);
-    if (std::ranges::find(available_formats, vk::SurfaceFormatKHR{format, colorspace}) == available_formats.end())
+    const auto surface_capabilities = context.physical_device.getSurfaceCapabilitiesKHR(context.surface);
+    const auto is_available = [&](vk::Format surface_format) {
+        return std::ranges::find(available_formats, vk::SurfaceFormatKHR{surface_format, colorspace}) != available_formats.end();
+    };
+    storage_images = use_storage_images && !srgb_sources && (surface_capabilities.supportedUsageFlags & vk::ImageUsageFlagBits::eStorage) &&
+                     is_available(storage_format);
+    vk::Format image_format = storage_images ? storage_format : format;
+    if (srgb_sources) {
+        if (is_available(srgb_format)) {
+            image_format = srgb_format;
+        } else {
+            spdlog::warn("No srgb surface format, the mirrored images are shown darker.");
+        }
+    }
+    if (!is_available(image_format))
         throw std::runtime_error("Failed to find required surface format.");
     const auto available_present_modes = context.physical_device.getSurfacePresentModesKHR(context.surface);
     if (std::ranges::find(available_present_modes, present_mode) == available_present_modes.end())
         throw std::runtime_error("Failed to find required surface present mode.");
 
-    const auto surface_capabilities = context.physical_device.getSurfaceCapabilitiesKHR(context.surface);
     if (surface_capabilities.currentExtent.width != std::numeric_limits<uint32_t>::max()) {
         extent = surface_capabilities.currentExtent;
     } else {
@@ -66,11 +92,12 @@ Monitor_swapchain::Monitor_swapchain(Context& context, size_t size_command_buffe
     swapchain = device.createSwapchainKHR(vk::SwapchainCreateInfoKHR{
         .surface = context.surface,
         .minImageCount = image_count,
-        .imageFormat = format,
+        .imageFormat = image_format,
         .imageColorSpace = colorspace,
         .imageExtent = extent,
         .imageArrayLayers = 1,
-        .imageUsage = vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferDst,
+        .imageUsage = vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferDst |
+                      (storage_images ? vk::ImageUsageFlagBits::eStorage : vk::ImageUsageFlags{}),
         .imageSharingMode = vk::SharingMode::eExclusive,
         .preTransform = surface_capabilities.currentTransform,
         .compositeAlpha = vk::CompositeAlphaFlagBitsKHR::eOpaque,
@@ -81,6 +108,15 @@ Monitor_swapchain::Monitor_swapchain(Context& context, size_t size_command_buffe
     const auto vec_images = device.getSwapchainImagesKHR(swapchain);
     for (size_t i = 0u; i < image_count; i++) {
         images[i] = vec_images[i];
+        if (storage_images) {
+            storage_image_views[i] = device.createImageView(vk::ImageViewCreateInfo{
+                .image = images[i],
+                .viewType = vk::ImageViewType::e2D,
+                .format = storage_format,
+                .subresourceRange =
+                    {.aspectMask = vk::ImageAspectFlagBits::eColor, .baseMipLevel = 0u, .levelCount = 1u, .baseArrayLayer = 0u, .layerCount = 1u}
+            });
+        }
     }
 
     create_synchronization(size_command_buffers);
@@ -98,6 +134,11 @@ void Monitor_swapchain::create_synchronization(size_t size_command_buffers) {
 Monitor_swapchain::~Monitor_swapchain() {
     if (!swapchain)
         return;
+    if (storage_images) {
+        for (const vk::ImageView image_view : storage_image_views) {
+            device.destroyImageView(image_view);
+        }
+    }
     device.destroySwapchainKHR(swapchain);
 
     for (size_t i = 0; i < semaphore_available.size(); i++) {
@@ -108,13 +149,24 @@ Monitor_swapchain::~Monitor_swapchain() {
     swapchain = nullptr;
 }
 
-void Monitor_swapchain::copy_image(vk::CommandBuffer command_buffer, vk::Image source_image, size_t command_pool_id, vk::Extent2D source_extent) {
+void Monitor_swapchain::acquire_image(size_t command_pool_id) {
     auto [result, framebuffer_id] = device.acquireNextImageKHR(swapchain, UINT64_MAX, semaphore_available[command_pool_id], {});
 
     if (result != vk::Result::eSuccess && result != vk::Result::eSuboptimalKHR) {
         throw std::runtime_error("failed to acquire swap chain image");
     }
     next_image_id = framebuffer_id;
+}
+
+uint32_t Monitor_swapchain::acquire_storage_image(size_t command_pool_id) {
+    acquire_image(command_pool_id);
+    next_image_traced = true;
+    return next_image_id;
+}
+
+void Monitor_swapchain::copy_image(vk::CommandBuffer command_buffer, vk::Image source_image, size_t command_pool_id, vk::Extent2D source_extent) {
+    acquire_image(command_pool_id);
+    next_image_traced = false;
 
     {
         std::array memory_barriers{
@@ -160,11 +212,11 @@ void Monitor_swapchain::copy_image(vk::CommandBuffer command_buffer, vk::Image s
 void Monitor_swapchain::present(vk::CommandBuffer& command_buffer, vk::Fence fence, size_t command_pool_id) {
     {
         vk::ImageMemoryBarrier2 memory_barrier{
-            .srcStageMask = vk::PipelineStageFlagBits2::eTransfer,
-            .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+            .srcStageMask = next_image_traced ? vk::PipelineStageFlagBits2::eRayTracingShaderKHR : vk::PipelineStageFlagBits2::eTransfer,
+            .srcAccessMask = next_image_traced ? vk::AccessFlagBits2::eShaderStorageWrite : vk::AccessFlagBits2::eTransferWrite,
             .dstStageMask = vk::PipelineStageFlagBits2::eBottomOfPipe,
             .dstAccessMask = {},
-            .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+            .oldLayout = next_image_traced ? vk::ImageLayout::eGeneral : vk::ImageLayout::eTransferDstOptimal,
             .newLayout = vk::ImageLayout::ePresentSrcKHR,
             .image = images[next_image_id],
             .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor, .baseMipLevel = 0, .levelCount = 1u, .baseArrayLayer = 0, .layerCount = 1}
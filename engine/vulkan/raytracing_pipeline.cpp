@@ -9,6 +9,19 @@ import tale.vulkan.command_buffer;
 import tale.vulkan.buffer;
 
 namespace tale::vulkan {
+// Push constants of the raygens and of the primary closest hits, the Frame block of frame.glsl
+export struct Frame_constants {
+    vk::Extent2D trace_extent;
+    vk::Extent2D previous_trace_extent; // Zero when there is no history to reproject
+    uint32_t index;
+    uint32_t static_instance_count;
+};
+
+// Primary, shadow, ambient occlusion and prepass, the TLAS instances offset their hit groups by model
+export constexpr uint32_t hit_groups_per_model = 4u;
+
+export constexpr vk::ShaderStageFlags frame_constants_stages = vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eClosestHitKHR;
+
 export class Raytracing_pipeline {
 public:
     vk::DescriptorSetLayout descriptor_set_layout;
@@ -16,6 +29,8 @@ public:
     vk::Pipeline pipeline;
 
     vk::StridedDeviceAddressRegionKHR raygen_address_region{};
+    vk::StridedDeviceAddressRegionKHR prepass_raygen_address_region{};
+    vk::StridedDeviceAddressRegionKHR foveation_reconstruct_raygen_address_region{};
     vk::StridedDeviceAddressRegionKHR miss_address_region{};
     vk::StridedDeviceAddressRegionKHR hit_address_region{};
     vk::StridedDeviceAddressRegionKHR callable_address_region{};
@@ -27,6 +42,8 @@ public:
     Raytracing_pipeline& operator=(Raytracing_pipeline&& other) = delete;
     ~Raytracing_pipeline();
 
+    void create_shader_binding_table(Upload_batch& upload_batch);
+
 private:
     vk::Device device;
     vk::PhysicalDeviceRayTracingPipelinePropertiesKHR raytracing_properties;
@@ -34,11 +51,12 @@ private:
 
     uint32_t group_count;
     uint32_t models_count;
+    vk::DeviceSize offset_prepass_raygen_group;
+    vk::DeviceSize offset_foveation_reconstruct_raygen_group;
     vk::DeviceSize offset_miss_group;
     vk::DeviceSize offset_hit_group;
 
     void create_pipeline(Scene& scene);
-    void create_shader_binding_table(Context& context);
 };
 }
 
@@ -46,6 +64,9 @@ module :private;
 
 namespace tale::vulkan {
 
+constexpr uint32_t raygen_group_count = 3u; // Main, prepass and foveation reconstruction
+constexpr uint32_t miss_group_count = 3u; // Primary, shadow/ambient occlusion and prepass
+
 Raytracing_pipeline::Raytracing_pipeline(Context& context, Scene& scene):
     device(context.device) {
 
@@ -54,7 +75,6 @@ Raytracing_pipeline::Raytracing_pipeline(Context& context, Scene& scene):
     context.physical_device.getProperties2(&properties);
 
     create_pipeline(scene);
-    create_shader_binding_table(context);
 }
 
 Raytracing_pipeline::~Raytracing_pipeline() {
@@ -64,6 +84,8 @@ Raytracing_pipeline::~Raytracing_pipeline() {
 }
 
 void Raytracing_pipeline::create_pipeline(Scene& scene) {
+    const auto distance_field_count =
+        static_cast<uint32_t>(std::ranges::count_if(scene.models, [](const Model& model) { return model.baked_distance_field.has_value(); }));
     const std::array bindings{
         // Acceleration structure
         vk::DescriptorSetLayoutBinding{
@@ -89,6 +111,51 @@ void Raytracing_pipeline::create_pipeline(Scene& scene) {
             .descriptorType = vk::DescriptorType::eStorageBuffer,
             .descriptorCount = 1u,
             .stageFlags = vk::ShaderStageFlagBits::eClosestHitKHR | vk::ShaderStageFlagBits::eMissKHR
+        },
+        // AABBs, indexed by instance custom index + primitive id
+        vk::DescriptorSetLayoutBinding{
+            .binding = 4u,
+            .descriptorType = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = 1u,
+            .stageFlags = vk::ShaderStageFlagBits::eIntersectionKHR | vk::ShaderStageFlagBits::eAnyHitKHR
+        },
+        // Ambient occlusion flags, indexed by instance id
+        vk::DescriptorSetLayoutBinding{
+            .binding = 5u, .descriptorType = vk::DescriptorType::eStorageBuffer, .descriptorCount = 1u, .stageFlags = vk::ShaderStageFlagBits::eClosestHitKHR
+        },
+        // Raymarching counters
+        vk::DescriptorSetLayoutBinding{
+            .binding = 6u, .descriptorType = vk::DescriptorType::eStorageBuffer, .descriptorCount = 1u, .stageFlags = vk::ShaderStageFlagBits::eIntersectionKHR
+        },
+        // Prepass distances
+        vk::DescriptorSetLayoutBinding{
+            .binding = 7u, .descriptorType = vk::DescriptorType::eStorageImage, .descriptorCount = 1u, .stageFlags = vk::ShaderStageFlagBits::eRaygenKHR
+        },
+        // Baked distance fields, indexed by DISTANCE_FIELD_INDEX
+        vk::DescriptorSetLayoutBinding{
+            .binding = 8u,
+            .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+            .descriptorCount = distance_field_count,
+            .stageFlags = vk::ShaderStageFlagBits::eIntersectionKHR | vk::ShaderStageFlagBits::eAnyHitKHR | vk::ShaderStageFlagBits::eClosestHitKHR
+        },
+        // Cameras, written right before the submission
+        vk::DescriptorSetLayoutBinding{
+            .binding = 9u,
+            .descriptorType = vk::DescriptorType::eUniformBuffer,
+            .descriptorCount = 1u,
+            .stageFlags = vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eIntersectionKHR | vk::ShaderStageFlagBits::eClosestHitKHR |
+                          vk::ShaderStageFlagBits::eAnyHitKHR
+        },
+        // Reprojection history of the previous frame, then of this frame
+        vk::DescriptorSetLayoutBinding{
+            .binding = 10u, .descriptorType = vk::DescriptorType::eStorageImage, .descriptorCount = 1u, .stageFlags = vk::ShaderStageFlagBits::eRaygenKHR
+        },
+        vk::DescriptorSetLayoutBinding{
+            .binding = 11u, .descriptorType = vk::DescriptorType::eStorageImage, .descriptorCount = 1u, .stageFlags = vk::ShaderStageFlagBits::eRaygenKHR
+        },
+        // Depths for the compositor
+        vk::DescriptorSetLayoutBinding{
+            .binding = 12u, .descriptorType = vk::DescriptorType::eStorageBuffer, .descriptorCount = 1u, .stageFlags = vk::ShaderStageFlagBits::eRaygenKHR
         }
     };
 
@@ -97,10 +164,9 @@ void Raytracing_pipeline::create_pipeline(Scene& scene) {
         );
 
     const vk::PushConstantRange push_constants{
-        .stageFlags = vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eIntersectionKHR | vk::ShaderStageFlagBits::eClosestHitKHR |
-                      vk::ShaderStageFlagBits::eAnyHitKHR,
+        .stageFlags = frame_constants_stages,
         .offset = 0,
-        .size = 2 * sizeof(Camera)
+        .size = sizeof(Frame_constants)
     };
 
     pipeline_layout = device.createPipelineLayout(vk::PipelineLayoutCreateInfo{
@@ -114,6 +180,14 @@ void Raytracing_pipeline::create_pipeline(Scene& scene) {
         vk::PipelineShaderStageCreateInfo{
             .stage = vk::ShaderStageFlagBits::eIntersectionKHR, .module = scene.shaders.shadow_ao_intersection.module, .pName = "main"
         },
+        vk::PipelineShaderStageCreateInfo{.stage = vk::ShaderStageFlagBits::eRaygenKHR, .module = scene.shaders.prepass_raygen.module, .pName = "main"},
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eClosestHitKHR, .module = scene.shaders.prepass_closest_hit.module, .pName = "main"
+        },
+        vk::PipelineShaderStageCreateInfo{.stage = vk::ShaderStageFlagBits::eMissKHR, .module = scene.shaders.prepass_miss.module, .pName = "main"},
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eRaygenKHR, .module = scene.shaders.foveation_reconstruct_raygen.module, .pName = "main"
+        },
     };
     std::vector groups{
         // Raygen
@@ -121,6 +195,16 @@ void Raytracing_pipeline::create_pipeline(Scene& scene) {
             .type = vk::RayTracingShaderGroupTypeKHR::eGeneral,
             .generalShader = 0, // raygen shader id
         },
+        // Prepass raygen
+        vk::RayTracingShaderGroupCreateInfoKHR{
+            .type = vk::RayTracingShaderGroupTypeKHR::eGeneral,
+            .generalShader = 4, // prepass raygen shader id
+        },
+        // Foveation reconstruction raygen
+        vk::RayTracingShaderGroupCreateInfoKHR{
+            .type = vk::RayTracingShaderGroupTypeKHR::eGeneral,
+            .generalShader = 7, // foveation reconstruction raygen shader id
+        },
         // Primary Miss
         vk::RayTracingShaderGroupCreateInfoKHR{
             .type = vk::RayTracingShaderGroupTypeKHR::eGeneral,
@@ -131,11 +215,30 @@ void Raytracing_pipeline::create_pipeline(Scene& scene) {
             .type = vk::RayTracingShaderGroupTypeKHR::eGeneral,
             .generalShader = 2, // shadow/ao miss shader id
         },
+        // Prepass Miss
+        vk::RayTracingShaderGroupCreateInfoKHR{
+            .type = vk::RayTracingShaderGroupTypeKHR::eGeneral,
+            .generalShader = 6, // prepass miss shader id
+        },
     };
     models_count = static_cast<uint32_t>(scene.models.size());
-    shader_stages.reserve(shader_stages.size() + models_count * 4);
-    groups.reserve(groups.size() + models_count * 3);
+    shader_stages.reserve(shader_stages.size() + models_count * 5);
+    groups.reserve(groups.size() + models_count * hit_groups_per_model);
+
+    // The LOD distances of each model are the constant_id 0 and 1 of common_types.glsl
+    const std::array lod_entries{
+        vk::SpecializationMapEntry{.constantID = 0u, .offset = 0u, .size = sizeof(float)},
+        vk::SpecializationMapEntry{.constantID = 1u, .offset = sizeof(float), .size = sizeof(float)},
+    };
+    std::vector<vk::SpecializationInfo> lod_specializations;
+    lod_specializations.reserve(models_count);
     for (const auto& model : scene.models) {
+        const vk::SpecializationInfo* lod_specialization = &lod_specializations.emplace_back(vk::SpecializationInfo{
+            .mapEntryCount = static_cast<uint32_t>(lod_entries.size()),
+            .pMapEntries = lod_entries.data(),
+            .dataSize = sizeof(model.lod_distances),
+            .pData = model.lod_distances.data()
+        });
         // Primary
         groups.push_back(vk::RayTracingShaderGroupCreateInfoKHR{
             .type = vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup,
@@ -154,18 +257,42 @@ void Raytracing_pipeline::create_pipeline(Scene& scene) {
             .anyHitShader = static_cast<uint32_t>(shader_stages.size() + 3),
             .intersectionShader = 3
         });
+        // Prepass
+        groups.push_back(vk::RayTracingShaderGroupCreateInfoKHR{
+            .type = vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup,
+            .closestHitShader = 5,
+            .intersectionShader = static_cast<uint32_t>(shader_stages.size() + 4)
+        });
 
         shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
-            .stage = vk::ShaderStageFlagBits::eIntersectionKHR, .module = model.shaders.primary_intersection.module, .pName = "main"
+            .stage = vk::ShaderStageFlagBits::eIntersectionKHR,
+            .module = model.shaders.primary_intersection.module,
+            .pName = "main",
+            .pSpecializationInfo = lod_specialization
         });
         shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
-            .stage = vk::ShaderStageFlagBits::eClosestHitKHR, .module = model.shaders.primary_closest_hit.module, .pName = "main"
+            .stage = vk::ShaderStageFlagBits::eClosestHitKHR,
+            .module = model.shaders.primary_closest_hit.module,
+            .pName = "main",
+            .pSpecializationInfo = lod_specialization
+        });
+        shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eAnyHitKHR,
+            .module = model.shaders.shadow_any_hit.module,
+            .pName = "main",
+            .pSpecializationInfo = lod_specialization
         });
-        shader_stages.push_back(
-            vk::PipelineShaderStageCreateInfo{.stage = vk::ShaderStageFlagBits::eAnyHitKHR, .module = model.shaders.shadow_any_hit.module, .pName = "main"}
-        );
         shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
-            .stage = vk::ShaderStageFlagBits::eAnyHitKHR, .module = model.shaders.ambient_occlusion_any_hit.module, .pName = "main"
+            .stage = vk::ShaderStageFlagBits::eAnyHitKHR,
+            .module = model.shaders.ambient_occlusion_any_hit.module,
+            .pName = "main",
+            .pSpecializationInfo = lod_specialization
+        });
+        shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eIntersectionKHR,
+            .module = model.shaders.prepass_intersection.module,
+            .pName = "main",
+            .pSpecializationInfo = lod_specialization
         });
     }
 
@@ -189,7 +316,7 @@ void Raytracing_pipeline::create_pipeline(Scene& scene) {
 
 constexpr uint32_t align_up(uint32_t value, size_t alignment) noexcept { return uint32_t((value + (uint32_t(alignment) - 1)) & ~uint32_t(alignment - 1)); }
 
-void Raytracing_pipeline::create_shader_binding_table(Context& context) {
+void Raytracing_pipeline::create_shader_binding_table(Upload_batch& upload_batch) {
     const uint32_t handle_size = raytracing_properties.shaderGroupHandleSize;
     const uint32_t handle_size_aligned = align_up(handle_size, raytracing_properties.shaderGroupHandleAlignment);
 
@@ -199,45 +326,49 @@ void Raytracing_pipeline::create_shader_binding_table(Context& context) {
     const uint32_t base_alignment = raytracing_properties.shaderGroupBaseAlignment;
     raygen_address_region.size = align_up(handle_size_aligned, base_alignment);
     raygen_address_region.stride = raygen_address_region.size;
-    miss_address_region.size = align_up(2 * handle_size_aligned, base_alignment);
+    prepass_raygen_address_region.size = raygen_address_region.size;
+    prepass_raygen_address_region.stride = raygen_address_region.size;
+    foveation_reconstruct_raygen_address_region.size = raygen_address_region.size;
+    foveation_reconstruct_raygen_address_region.stride = raygen_address_region.size;
+    miss_address_region.size = align_up(miss_group_count * handle_size_aligned, base_alignment);
     miss_address_region.stride = handle_size_aligned;
-    hit_address_region.size = align_up(3 * models_count * handle_size_aligned, base_alignment);
+    hit_address_region.size = align_up(hit_groups_per_model * models_count * handle_size_aligned, base_alignment);
     hit_address_region.stride = handle_size_aligned;
 
-    const vk::DeviceSize table_size = raygen_address_region.size + miss_address_region.size + hit_address_region.size + callable_address_region.size;
+    const vk::DeviceSize table_size = raygen_address_region.size + prepass_raygen_address_region.size + foveation_reconstruct_raygen_address_region.size +
+                                      miss_address_region.size + hit_address_region.size + callable_address_region.size;
     std::vector<uint8_t> temp_table(table_size, 0);
 
-    offset_miss_group = raygen_address_region.size;
+    offset_prepass_raygen_group = raygen_address_region.size;
+    offset_foveation_reconstruct_raygen_group = offset_prepass_raygen_group + prepass_raygen_address_region.size;
+    offset_miss_group = offset_foveation_reconstruct_raygen_group + foveation_reconstruct_raygen_address_region.size;
     offset_hit_group = offset_miss_group + miss_address_region.size;
 
     // Copy raygen
     memcpy(temp_table.data(), handles_data.data(), handle_size);
+    memcpy(temp_table.data() + offset_prepass_raygen_group, handles_data.data() + 1 * handle_size, handle_size);
+    memcpy(temp_table.data() + offset_foveation_reconstruct_raygen_group, handles_data.data() + 2 * handle_size, handle_size);
     // Copy miss
-    memcpy(temp_table.data() + offset_miss_group, handles_data.data() + 1 * handle_size, handle_size);
-    memcpy(temp_table.data() + offset_miss_group + handle_size_aligned, handles_data.data() + 2 * handle_size, handle_size);
-    // Copy hit
-    for (uint32_t i = 0; i < models_count; ++i) {
-        memcpy(temp_table.data() + offset_hit_group + i * 3 * handle_size_aligned, handles_data.data() + (3 + 3 * i) * handle_size, handle_size);
-        memcpy(temp_table.data() + offset_hit_group + (i * 3 + 1) * handle_size_aligned, handles_data.data() + (3 + 3 * i + 1) * handle_size, handle_size);
-        memcpy(temp_table.data() + offset_hit_group + (i * 3 + 2) * handle_size_aligned, handles_data.data() + (3 + 3 * i + 2) * handle_size, handle_size);
+    for (uint32_t i = 0; i < miss_group_count; ++i) {
+        memcpy(temp_table.data() + offset_miss_group + i * handle_size_aligned, handles_data.data() + (raygen_group_count + i) * handle_size, handle_size);
     }
-    // memcpy(temp_table.data() + offset_hit_group, handles_data.data() + 3 * handle_size, 3 * models_count * handle_size);
-
-    {
-        One_time_command_buffer command_buffer(context.device, context.command_pool, context.queue);
-        Buffer_from_staged buffer_and_staged(
-            context.device, context.allocator, command_buffer.command_buffer,
-            vk::BufferCreateInfo{
-                .size = temp_table.size(), .usage = vk::BufferUsageFlagBits::eShaderBindingTableKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress
-            },
-            temp_table.data()
-        );
-        shader_binding_table = std::move(buffer_and_staged.result);
-        command_buffer.submit_and_wait_idle();
+    // Copy hit
+    const uint32_t first_hit_group = raygen_group_count + miss_group_count;
+    for (uint32_t i = 0; i < hit_groups_per_model * models_count; ++i) {
+        memcpy(temp_table.data() + offset_hit_group + i * handle_size_aligned, handles_data.data() + (first_hit_group + i) * handle_size, handle_size);
     }
 
+    shader_binding_table = upload_batch.upload(
+        vk::BufferCreateInfo{
+            .size = temp_table.size(), .usage = vk::BufferUsageFlagBits::eShaderBindingTableKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress
+        },
+        temp_table.data()
+    );
+
     const vk::DeviceAddress table_address = device.getBufferAddress(vk::BufferDeviceAddressInfo{.buffer = shader_binding_table.buffer});
     raygen_address_region.deviceAddress = table_address;
+    prepass_raygen_address_region.deviceAddress = table_address + offset_prepass_raygen_group;
+    foveation_reconstruct_raygen_address_region.deviceAddress = table_address + offset_foveation_reconstruct_raygen_group;
     miss_address_region.deviceAddress = table_address + offset_miss_group;
     hit_address_region.deviceAddress = table_address + offset_hit_group;
 }
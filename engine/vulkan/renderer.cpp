@@ -1,6 +1,7 @@
 
 module;
 #include <glm/glm.hpp>
+#include <spdlog/spdlog.h>
 #include <stdexcept>
 #include <vma_includes.hpp>
 export module tale.vulkan.renderer;
@@ -15,18 +16,54 @@ import tale.vulkan.image;
 import tale.vulkan.texture;
 import tale.vulkan.raytracing_pipeline;
 import tale.vulkan.acceleration_structure;
+import tale.vulkan.distance_field;
 
 namespace tale::vulkan {
 
 struct Per_frame {
     Storage_texture render_texture;
+    Storage_texture prepass_texture; // Distances reached by the cones of prepass.rgen
     Tlas tlas;
     Vma_buffer materials;
     Vma_buffer lights;
+    Vma_buffer raymarch_statistics; // Filled by primary.rint when RAYMARCH_STATISTICS is defined
+    Vma_buffer cameras; // Written by end_frame, as late as possible before the submission
+    Vma_buffer depths; // One float per pixel of the images when the shaders write depth
+    vk::Image traced_image; // The render texture, one of the output images or a monitor swapchain image
+    vk::ImageView bound_image_view; // Storage image of the descriptor set, changed when the traced image changes
+    bool timestamps_written = false;
+};
+
+// Cameras uniform of camera.glsl
+struct Frame_cameras {
+    std::array<Camera, 2> current;
+    std::array<Camera, 2> previous;
+};
+
+struct Raymarch_statistics {
+    uint32_t iterations;
+    uint32_t marches;
+};
+
+// Scale of the traced extent from the GPU time of the previous frames, the blits to the swapchains upscale the result
+class Resolution_controller {
+public:
+    float scale = 1.0f;
+
+    void update(std::chrono::nanoseconds gpu_time, std::chrono::nanoseconds display_period);
+};
+
+// Image written by Renderer::trace, only the top left extent is traced
+export struct Traced_image {
+    vk::Image image;
+    vk::Extent2D extent;
+    vk::Buffer depths; // Null unless the shaders write depth, with rows of the image width
 };
 
 export class Renderer {
 public:
+    std::chrono::nanoseconds display_period{11'111'111}; // Frame budget of the resolution controller, 90 Hz until the system sets it
+
     Renderer(Context& context, Scene& scene, size_t size_command_buffers);
     Renderer(const Renderer& other) = delete;
     Renderer(Renderer&& other) = delete;
@@ -37,20 +74,46 @@ public:
     void reset_swapchain(Context& context);
     void create_per_frame_data(Context& context, Scene& scene, vk::Extent2D extent, size_t command_pool_size);
     void create_descriptor_sets(vk::DescriptorPool descriptor_pool, size_t command_pool_size);
+    // Images of the full extent that trace can write instead of the render texture, e.g. the images of the XR swapchain
+    // The window is recreated to mirror srgb images without decoding them
+    void set_output_images(Context& context, std::span<const vk::Image> images, bool srgb_images, vk::Format view_format);
 
     void start_frame(vk::CommandBuffer command_buffer, size_t command_pool_id, const Scene& scene);
-    vk::Image trace(vk::CommandBuffer command_buffer, size_t command_pool_id, const Scene& scene, vk::Extent2D extent);
-    void end_frame(vk::CommandBuffer command_buffer, vk::Fence fence, size_t command_pool_id);
+    // Unless traced into the window, the traced image is left in transfer source layout, an output image has to be transitioned by its owner
+    Traced_image trace(
+        vk::CommandBuffer command_buffer, size_t command_pool_id, const Scene& scene, vk::Extent2D full_extent,
+        std::optional<size_t> output_image_index = std::nullopt
+    );
+    void end_frame(vk::CommandBuffer command_buffer, vk::Fence fence, size_t command_pool_id, const Scene& scene);
+    // Builds, refits and skipped updates summed over the TLAS of every frame in flight
+    Tlas_statistics tlas_statistics() const noexcept;
 
 private:
     vk::Device device;
     Monitor_swapchain swapchain;
     Raytracing_pipeline pipeline;
     std::vector<Per_frame> per_frame;
+    Vma_buffer aabbs; // Read by the shaders to clip the raymarching
     std::vector<Blas> blas; // One per model
+    std::vector<Distance_field> distance_fields; // One per model with a baked distance field
+    std::unique_ptr<Upload_batch> distance_field_bake; // Until the GPU has baked the distance fields
+    vk::Sampler distance_field_sampler;
+    std::vector<vk::Image> output_images;
+    std::vector<vk::ImageView> output_image_views;
+    bool srgb_output_images = false;
+    std::vector<Storage_texture> histories; // Color and hit distance of the pixels, each frame reads one and writes the other
+    std::array<Camera, 2> previous_cameras;
+    vk::Extent2D previous_trace_extent{};
+    uint32_t frame_index = 0u;
     size_t size_command_buffers;
 
     std::vector<vk::DescriptorSet> descriptor_sets;
+    vk::QueryPool timestamps; // Start and end of the tracing of each frame
+    float timestamp_period; // In nanoseconds
+    Resolution_controller resolution_controller;
+    uint64_t raymarch_iterations = 0u;
+    uint64_t raymarch_marches = 0u;
+    size_t raymarch_statistics_frames = 0u;
 
     void update_per_frame_data(const Scene& scene, size_t command_pool_id);
 };
@@ -58,21 +121,129 @@ private:
 
 module :private;
 
+constexpr size_t raymarch_statistics_period = 600u; // In frames
+
+// One texel per block of 4x4 pixels of each eye, the width stays even so that stereo images split in two
+constexpr vk::Extent2D prepass_extent(vk::Extent2D extent) noexcept { return {2u * ((extent.width + 7u) / 8u), (extent.height + 3u) / 4u}; }
+constexpr vk::Extent2D prepass_eye_extent(vk::Extent2D eye_extent) noexcept { return {(eye_extent.width + 3u) / 4u, (eye_extent.height + 3u) / 4u}; }
+
+constexpr float min_resolution_scale = 0.5f;
+constexpr float frame_budget_ratio = 0.85f; // Part of the display period the tracing can use, the copies and the compositor need the rest
+constexpr float resolution_hysteresis = 0.05f; // Load difference ignored to avoid oscillations
+
+// Build the BLAS on the CPU cores when the device allows it, the GPU meanwhile runs the first uploads
+constexpr bool use_host_blas_build = true;
+
 namespace tale::vulkan {
+
+void Resolution_controller::update(std::chrono::nanoseconds gpu_time, std::chrono::nanoseconds display_period) {
+    if (gpu_time.count() <= 0 || display_period.count() <= 0) {
+        return;
+    }
+    const float load = static_cast<float>(gpu_time.count()) / (frame_budget_ratio * static_cast<float>(display_period.count()));
+    if (std::abs(load - 1.0f) < resolution_hysteresis) {
+        return;
+    }
+    // The cost follows the number of rays, the square of the scale
+    const float target_scale = scale / std::sqrt(load);
+    // Drop fast to avoid missing frames, come back slowly
+    const float smoothing = load > 1.0f ? 0.5f : 0.1f;
+    scale = std::clamp(scale + smoothing * (target_scale - scale), min_resolution_scale, 1.0f);
+}
+
+// Stays even so that stereo images keep two eyes of the same size
+vk::Extent2D scaled_extent(vk::Extent2D extent, float scale) noexcept {
+    const auto half_width = static_cast<uint32_t>(std::lround(0.5f * scale * static_cast<float>(extent.width)));
+    const auto height = static_cast<uint32_t>(std::lround(scale * static_cast<float>(extent.height)));
+    return {2u * std::clamp(half_width, 1u, extent.width / 2u), std::clamp(height, 1u, extent.height)};
+}
+
 Renderer::Renderer(Context& context, Scene& scene, size_t size_command):
     device(context.device),
     swapchain(context, size_command),
     pipeline(context, scene),
     size_command_buffers(size_command) {
-    blas.reserve(scene.models.size());
-    for (const auto& model : scene.models) {
-        blas.push_back(Blas(context, model));
+    timestamp_period = context.physical_device.getProperties().limits.timestampPeriod;
+    // Runs on the GPU while the BLAS are built, the frames are submitted after it
+    Distance_field_bake bake = bake_distance_fields(context, scene);
+    distance_fields = std::move(bake.distance_fields);
+    distance_field_bake = std::move(bake.batch);
+    distance_field_sampler = device.createSampler(vk::SamplerCreateInfo{
+        .magFilter = vk::Filter::eLinear,
+        .minFilter = vk::Filter::eLinear,
+        .mipmapMode = vk::SamplerMipmapMode::eNearest,
+        .addressModeU = vk::SamplerAddressMode::eClampToEdge,
+        .addressModeV = vk::SamplerAddressMode::eClampToEdge,
+        .addressModeW = vk::SamplerAddressMode::eClampToEdge,
+        .maxLod = 0.0f
+    });
+
+    Upload_batch upload_batch(context);
+    pipeline.create_shader_binding_table(upload_batch);
+    const Blas_geometry blas_geometry(scene.models);
+    aabbs = upload_batch.upload(
+        vk::BufferCreateInfo{
+            .size = sizeof(vk::AabbPositionsKHR) * blas_geometry.aabbs.size(),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+                     vk::BufferUsageFlagBits::eShaderDeviceAddress
+        },
+        blas_geometry.aabbs.data()
+    );
+    if (use_host_blas_build && context.acceleration_structure_host_commands) {
+        upload_batch.submit();
+        Upload_batch compaction_batch(context);
+        blas = build_blas_on_host(context, blas_geometry, compaction_batch);
+        compaction_batch.submit();
+    } else {
+        blas = build_blas(context, blas_geometry, device.getBufferAddress(vk::BufferDeviceAddressInfo{.buffer = aabbs.buffer}), upload_batch);
+        Blas_compaction compaction(context, blas, upload_batch.command_buffer);
+        upload_batch.wait();
+
+        Upload_batch compaction_batch(context);
+        compaction.compact(context, blas, compaction_batch);
+        compaction_batch.submit();
     }
 }
 
-Renderer::~Renderer() { device.waitIdle(); }
+Renderer::~Renderer() {
+    device.waitIdle();
+    device.destroySampler(distance_field_sampler);
+    device.destroyQueryPool(timestamps);
+    for (const vk::ImageView image_view : output_image_views) {
+        device.destroyImageView(image_view);
+    }
+}
+
+void Renderer::set_output_images(Context& context, std::span<const vk::Image> images, bool srgb_images, vk::Format view_format) {
+    if (srgb_images != srgb_output_images) {
+        srgb_output_images = srgb_images;
+        reset_swapchain(context);
+    }
+    // The views of the previous images may still be bound or traced into
+    device.waitIdle();
+    for (const vk::ImageView image_view : output_image_views) {
+        device.destroyImageView(image_view);
+    }
+    for (Per_frame& frame_data : per_frame) {
+        frame_data.bound_image_view = nullptr;
+    }
+    output_images.assign(images.begin(), images.end());
+    output_image_views.clear();
+    output_image_views.reserve(images.size());
+    for (const vk::Image image : images) {
+        output_image_views.push_back(device.createImageView(vk::ImageViewCreateInfo{
+            .image = image,
+            .viewType = vk::ImageViewType::e2D,
+            .format = view_format,
+            .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor, .baseMipLevel = 0u, .levelCount = 1u, .baseArrayLayer = 0u, .layerCount = 1u}
+        }));
+    }
+}
 
 void Renderer::start_frame(vk::CommandBuffer command_buffer, size_t command_pool_id, const Scene& scene) {
+    if (distance_field_bake && distance_field_bake->is_complete()) {
+        distance_field_bake.reset();
+    }
     update_per_frame_data(scene, command_pool_id);
     command_buffer.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
 
@@ -91,31 +262,182 @@ void Renderer::start_frame(vk::CommandBuffer command_buffer, size_t command_pool
     );
 }
 
-vk::Image Renderer::trace(vk::CommandBuffer command_buffer, size_t command_pool_id, const Scene& scene, vk::Extent2D extent) {
+Traced_image Renderer::trace(
+    vk::CommandBuffer command_buffer, size_t command_pool_id, const Scene& scene, vk::Extent2D full_extent, std::optional<size_t> output_image_index
+) {
+    Per_frame& frame_data = per_frame[command_pool_id];
+    const auto first_query = 2u * static_cast<uint32_t>(command_pool_id);
+    command_buffer.resetQueryPool(timestamps, first_query, 2u);
+    command_buffer.writeTimestamp2(vk::PipelineStageFlagBits2::eTopOfPipe, timestamps, first_query);
+    frame_data.timestamps_written = true;
+
+    // The images keep the full extent, only the top left part is traced
+    const vk::Extent2D extent = scaled_extent(full_extent, resolution_controller.scale);
+
+    frame_data.traced_image = frame_data.render_texture.image.image;
+    vk::ImageView image_view = frame_data.render_texture.image_view;
+    bool traced_to_window = false;
+    if (output_image_index) {
+        frame_data.traced_image = output_images[*output_image_index];
+        image_view = output_image_views[*output_image_index];
+    } else if (swapchain.storage_images && extent == swapchain.extent) {
+        // A monitor swapchain image can only replace the render texture when no upscale is needed
+        const uint32_t image_id = swapchain.acquire_storage_image(command_pool_id);
+        frame_data.traced_image = swapchain.images[image_id];
+        image_view = swapchain.storage_image_views[image_id];
+        traced_to_window = true;
+    }
+    if (image_view != frame_data.bound_image_view) {
+        // The set of this frame is not in use anymore, it can point to the image traced this frame
+        const vk::DescriptorImageInfo image_info{.imageView = image_view, .imageLayout = vk::ImageLayout::eGeneral};
+        device.updateDescriptorSets(
+            vk::WriteDescriptorSet{
+                .dstSet = descriptor_sets[command_pool_id],
+                .dstBinding = 1,
+                .dstArrayElement = 0,
+                .descriptorCount = 1,
+                .descriptorType = vk::DescriptorType::eStorageImage,
+                .pImageInfo = &image_info
+            },
+            {}
+        );
+        frame_data.bound_image_view = image_view;
+    }
+    if (frame_data.traced_image != frame_data.render_texture.image.image) {
+        // Only the traced part is shown, the previous content can be discarded
+        const vk::ImageMemoryBarrier2 to_general{
+            .srcStageMask = vk::PipelineStageFlagBits2::eTopOfPipe,
+            .srcAccessMask = {},
+            .dstStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+            .dstAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .oldLayout = vk::ImageLayout::eUndefined,
+            .newLayout = vk::ImageLayout::eGeneral,
+            .image = frame_data.traced_image,
+            .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor, .baseMipLevel = 0, .levelCount = 1u, .baseArrayLayer = 0, .layerCount = 1}
+        };
+        command_buffer.pipelineBarrier2(vk::DependencyInfo{.imageMemoryBarrierCount = 1, .pImageMemoryBarriers = &to_general});
+    }
 
     command_buffer.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, pipeline.pipeline);
     command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eRayTracingKHR, pipeline.pipeline_layout, 0, descriptor_sets[command_pool_id], {});
 
-    command_buffer.pushConstants(
-        pipeline.pipeline_layout,
-        vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eIntersectionKHR | vk::ShaderStageFlagBits::eClosestHitKHR |
-            vk::ShaderStageFlagBits::eAnyHitKHR /*| vk::ShaderStageFlagBits::eMissKHR*/
-        ,
-        0, 2 * sizeof(Camera), &scene.cameras
+    if (scene.shaders.reprojected) {
+        const vk::DescriptorImageInfo previous_history_info{.imageView = histories[frame_index % 2u].image_view, .imageLayout = vk::ImageLayout::eGeneral};
+        const vk::DescriptorImageInfo history_info{.imageView = histories[(frame_index + 1u) % 2u].image_view, .imageLayout = vk::ImageLayout::eGeneral};
+        device.updateDescriptorSets(
+            std::array{
+                vk::WriteDescriptorSet{
+                    .dstSet = descriptor_sets[command_pool_id],
+                    .dstBinding = 10,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType = vk::DescriptorType::eStorageImage,
+                    .pImageInfo = &previous_history_info
+                },
+                vk::WriteDescriptorSet{
+                    .dstSet = descriptor_sets[command_pool_id],
+                    .dstBinding = 11,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType = vk::DescriptorType::eStorageImage,
+                    .pImageInfo = &history_info
+                }
+            },
+            {}
+        );
+        // The previous frame wrote the history read now and read the one written now
+        const vk::MemoryBarrier2 history_barrier{
+            .srcStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+            .dstAccessMask = vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite
+        };
+        command_buffer.pipelineBarrier2(vk::DependencyInfo{.memoryBarrierCount = 1, .pMemoryBarriers = &history_barrier});
+    }
+    const Frame_constants constants{
+        .trace_extent = extent,
+        .previous_trace_extent = scene.shaders.reprojected ? previous_trace_extent : vk::Extent2D{},
+        .index = frame_index,
+        .static_instance_count = static_cast<uint32_t>(frame_data.tlas.static_instance_count())
+    };
+    command_buffer.pushConstants(pipeline.pipeline_layout, frame_constants_stages, 0, sizeof(Frame_constants), &constants);
+    previous_trace_extent = extent;
+    frame_index++;
+
+    // One launch layer per eye, see launch_eye
+    const uint32_t view_count = scene.shaders.view_count;
+    const vk::Extent2D eye_extent{extent.width / view_count, extent.height};
+
+    // Quarter resolution cones first, they give the distance where the rays of each block can start
+    const vk::Extent2D prepass = prepass_eye_extent(eye_extent);
+    command_buffer.traceRaysKHR(
+        &pipeline.prepass_raygen_address_region, &pipeline.miss_address_region, &pipeline.hit_address_region, &pipeline.callable_address_region,
+        prepass.width, prepass.height, view_count
     );
+    const vk::ImageMemoryBarrier2 prepass_barrier{
+        .srcStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+        .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+        .dstStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+        .dstAccessMask = vk::AccessFlagBits2::eShaderStorageRead,
+        .oldLayout = vk::ImageLayout::eGeneral,
+        .newLayout = vk::ImageLayout::eGeneral,
+        .image = frame_data.prepass_texture.image.image,
+        .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor, .baseMipLevel = 0, .levelCount = 1u, .baseArrayLayer = 0, .layerCount = 1}
+    };
+    command_buffer.pipelineBarrier2(vk::DependencyInfo{.imageMemoryBarrierCount = 1, .pImageMemoryBarriers = &prepass_barrier});
 
     command_buffer.traceRaysKHR(
-        &pipeline.raygen_address_region, &pipeline.miss_address_region, &pipeline.hit_address_region, &pipeline.callable_address_region, extent.width,
-        extent.height, 1u
+        &pipeline.raygen_address_region, &pipeline.miss_address_region, &pipeline.hit_address_region, &pipeline.callable_address_region,
+        eye_extent.width, eye_extent.height, view_count
     );
+    if (scene.shaders.foveated) {
+        // The reconstruction reads the pixels traced by the main raygen, in the history and the depths as well
+        const vk::MemoryBarrier2 storage_barrier{
+            .srcStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+            .dstAccessMask = vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite
+        };
+        const vk::ImageMemoryBarrier2 foveation_barrier{
+            .srcStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+            .dstAccessMask = vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite,
+            .oldLayout = vk::ImageLayout::eGeneral,
+            .newLayout = vk::ImageLayout::eGeneral,
+            .image = frame_data.traced_image,
+            .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor, .baseMipLevel = 0, .levelCount = 1u, .baseArrayLayer = 0, .layerCount = 1}
+        };
+        command_buffer.pipelineBarrier2(vk::DependencyInfo{
+            .memoryBarrierCount = 1,
+            .pMemoryBarriers = &storage_barrier,
+            .imageMemoryBarrierCount = 1,
+            .pImageMemoryBarriers = &foveation_barrier
+        });
+        command_buffer.traceRaysKHR(
+            &pipeline.foveation_reconstruct_raygen_address_region, &pipeline.miss_address_region, &pipeline.hit_address_region,
+            &pipeline.callable_address_region, eye_extent.width, eye_extent.height, view_count
+        );
+    }
 
-    Per_frame& frame_data = per_frame[command_pool_id];
-    swapchain.copy_image(command_buffer, frame_data.render_texture.image.image, command_pool_id, extent);
-    return frame_data.render_texture.image.image;
+    const vk::BufferMemoryBarrier2 statistics_barrier{
+        .srcStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+        .srcAccessMask = vk::AccessFlagBits2::eShaderWrite,
+        .dstStageMask = vk::PipelineStageFlagBits2::eHost,
+        .dstAccessMask = vk::AccessFlagBits2::eHostRead,
+        .buffer = frame_data.raymarch_statistics.buffer,
+        .size = VK_WHOLE_SIZE
+    };
+    command_buffer.pipelineBarrier2(vk::DependencyInfo{.bufferMemoryBarrierCount = 1, .pBufferMemoryBarriers = &statistics_barrier});
+    command_buffer.writeTimestamp2(vk::PipelineStageFlagBits2::eRayTracingShaderKHR, timestamps, first_query + 1u);
+    if (!traced_to_window) {
+        swapchain.copy_image(command_buffer, frame_data.traced_image, command_pool_id, extent);
+    }
+    return {.image = frame_data.traced_image, .extent = extent, .depths = scene.shaders.writes_depth ? frame_data.depths.buffer : vk::Buffer{}};
 }
 
-void Renderer::end_frame(vk::CommandBuffer command_buffer, vk::Fence fence, size_t command_pool_id) {
-    {
+void Renderer::end_frame(vk::CommandBuffer command_buffer, vk::Fence fence, size_t command_pool_id, const Scene& scene) {
+    if (per_frame[command_pool_id].traced_image == per_frame[command_pool_id].render_texture.image.image) {
         vk::ImageMemoryBarrier2 memory_barrier{
             .srcStageMask = vk::PipelineStageFlagBits2::eTransfer,
             .srcAccessMask = vk::AccessFlagBits2::eTransferRead,
@@ -128,19 +450,32 @@ void Renderer::end_frame(vk::CommandBuffer command_buffer, vk::Fence fence, size
         };
         command_buffer.pipelineBarrier2(vk::DependencyInfo{.imageMemoryBarrierCount = 1, .pImageMemoryBarriers = &memory_barrier});
     }
+    // The submission makes the host writes visible, the poses can change until then
+    const Frame_cameras frame_cameras{.current = scene.cameras, .previous = previous_cameras};
+    Vma_buffer& cameras = per_frame[command_pool_id].cameras;
+    cameras.copy(&frame_cameras, sizeof(Frame_cameras));
+    cameras.flush();
+    previous_cameras = scene.cameras;
     swapchain.present(command_buffer, fence, command_pool_id);
 }
 
 void Renderer::reset_swapchain(Context& context) {
     device.waitIdle();
+    // The views of the storage images are recreated
+    for (Per_frame& frame_data : per_frame) {
+        frame_data.bound_image_view = nullptr;
+    }
     // We want to call the destructor before the constructor
     swapchain.~Monitor_swapchain();
-    [[maybe_unused]] Monitor_swapchain* s = new (&swapchain) Monitor_swapchain(context, size_command_buffers);
+    [[maybe_unused]] Monitor_swapchain* s = new (&swapchain) Monitor_swapchain(context, size_command_buffers, srgb_output_images);
 }
 
 void Renderer::create_per_frame_data(Context& context, Scene& scene, vk::Extent2D extent, size_t command_pool_size) {
     per_frame.reserve(command_pool_size);
-    One_time_command_buffer command_buffer(device, context.command_pool, context.queue);
+    timestamps = device.createQueryPool(
+        vk::QueryPoolCreateInfo{.queryType = vk::QueryType::eTimestamp, .queryCount = 2u * static_cast<uint32_t>(command_pool_size)}
+    );
+    Upload_batch upload_batch(context);
     for (size_t i = 0u; i < command_pool_size; i++) {
         Vma_buffer material_buffer = Vma_buffer(
             context.device, context.allocator,
@@ -156,13 +491,49 @@ void Renderer::create_per_frame_data(Context& context, Scene& scene, vk::Extent2
                 .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, .usage = VMA_MEMORY_USAGE_AUTO
             }
         );
+        Vma_buffer raymarch_statistics_buffer = Vma_buffer(
+            context.device, context.allocator,
+            vk::BufferCreateInfo{.size = sizeof(Raymarch_statistics), .usage = vk::BufferUsageFlagBits::eStorageBuffer},
+            VmaAllocationCreateInfo{.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT, .usage = VMA_MEMORY_USAGE_AUTO}
+        );
+        Vma_buffer depths_buffer{};
+        if (scene.shaders.writes_depth) {
+            depths_buffer = Vma_buffer(
+                context.device, context.allocator,
+                vk::BufferCreateInfo{
+                    .size = sizeof(float) * extent.width * extent.height,
+                    .usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferSrc
+                },
+                VmaAllocationCreateInfo{.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE}
+            );
+        }
+        Vma_buffer cameras_buffer = Vma_buffer(
+            context.device, context.allocator,
+            vk::BufferCreateInfo{.size = sizeof(Frame_cameras), .usage = vk::BufferUsageFlagBits::eUniformBuffer},
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, .usage = VMA_MEMORY_USAGE_AUTO
+            }
+        );
+        const Raymarch_statistics zero{};
+        raymarch_statistics_buffer.copy(&zero, sizeof(Raymarch_statistics));
+        raymarch_statistics_buffer.flush();
         per_frame.push_back(Per_frame{
-            .render_texture = Storage_texture(context, extent, command_buffer.command_buffer),
-            .tlas = {context, blas, scene},
+            .render_texture = Storage_texture(context, extent, upload_batch.command_buffer),
+            .prepass_texture = Storage_texture(context, prepass_extent(extent), upload_batch.command_buffer, vk::Format::eR32Sfloat),
+            .tlas = {context, blas, scene, upload_batch.command_buffer},
             .materials = std::move(material_buffer),
             .lights = std::move(lights_buffer),
+            .raymarch_statistics = std::move(raymarch_statistics_buffer),
+            .cameras = std::move(cameras_buffer),
+            .depths = std::move(depths_buffer),
         });
     }
+    if (scene.shaders.reprojected) {
+        histories.reserve(2u);
+        for (size_t i = 0u; i < 2u; i++) {
+            histories.emplace_back(context, extent, upload_batch.command_buffer, vk::Format::eR16G16B16A16Sfloat);
+        }
+    }
 }
 
 void Renderer::update_per_frame_data(const Scene& scene, size_t command_pool_id) {
@@ -170,6 +541,49 @@ void Renderer::update_per_frame_data(const Scene& scene, size_t command_pool_id)
     per_frame[command_pool_id].lights.copy(scene.lights.data(), sizeof(Light) * scene.lights.size());
     per_frame[command_pool_id].materials.flush();
     per_frame[command_pool_id].lights.flush();
+
+    // The previous frame using this data is done, its GPU time drives the resolution
+    if (per_frame[command_pool_id].timestamps_written) {
+        const auto [result, ticks] = device.getQueryPoolResults<uint64_t>(
+            timestamps, 2u * static_cast<uint32_t>(command_pool_id), 2u, 2u * sizeof(uint64_t), sizeof(uint64_t), vk::QueryResultFlagBits::e64
+        );
+        if (result == vk::Result::eSuccess) {
+            const double gpu_time = static_cast<double>(ticks[1] - ticks[0]) * static_cast<double>(timestamp_period);
+            resolution_controller.update(std::chrono::nanoseconds(static_cast<int64_t>(gpu_time)), display_period);
+        }
+    }
+
+    // The previous frame using this data is done, collect its counters
+    Vma_buffer& statistics_buffer = per_frame[command_pool_id].raymarch_statistics;
+    statistics_buffer.invalidate();
+    auto* statistics = static_cast<Raymarch_statistics*>(statistics_buffer.mapped);
+    raymarch_iterations += statistics->iterations;
+    raymarch_marches += statistics->marches;
+    *statistics = Raymarch_statistics{};
+    statistics_buffer.flush();
+    if (++raymarch_statistics_frames == raymarch_statistics_period) {
+        if (raymarch_marches > 0u) {
+            spdlog::info(
+                "Raymarching: {:.2f} iterations on average over {} marches.",
+                static_cast<double>(raymarch_iterations) / static_cast<double>(raymarch_marches), raymarch_marches
+            );
+        }
+        const Tlas_statistics tlas = tlas_statistics();
+        spdlog::info("TLAS: {} builds, {} refits, {} skipped updates.", tlas.builds, tlas.refits, tlas.skipped);
+        raymarch_iterations = 0u;
+        raymarch_marches = 0u;
+        raymarch_statistics_frames = 0u;
+    }
+}
+
+Tlas_statistics Renderer::tlas_statistics() const noexcept {
+    Tlas_statistics total{};
+    for (const Per_frame& frame_data : per_frame) {
+        total.builds += frame_data.tlas.statistics.builds;
+        total.refits += frame_data.tlas.statistics.refits;
+        total.skipped += frame_data.tlas.statistics.skipped;
+    }
+    return total;
 }
 
 void Renderer::create_descriptor_sets(vk::DescriptorPool descriptor_pool, size_t command_pool_size) {
@@ -179,6 +593,7 @@ void Renderer::create_descriptor_sets(vk::DescriptorPool descriptor_pool, size_t
     });
 
     for (size_t i = 0; i < command_pool_size; i++) {
+        per_frame[i].bound_image_view = per_frame[i].render_texture.image_view;
         const vk::WriteDescriptorSetAccelerationStructureKHR descriptor_acceleration_structure_info{
             .accelerationStructureCount = 1u, .pAccelerationStructures = &(per_frame[i].tlas.acceleration_structure)
         };
@@ -186,6 +601,11 @@ void Renderer::create_descriptor_sets(vk::DescriptorPool descriptor_pool, size_t
 
         const vk::DescriptorBufferInfo material_info{.buffer = per_frame[i].materials.buffer, .offset = 0u, .range = VK_WHOLE_SIZE};
         const vk::DescriptorBufferInfo light_info{.buffer = per_frame[i].lights.buffer, .offset = 0u, .range = VK_WHOLE_SIZE};
+        const vk::DescriptorBufferInfo aabb_info{.buffer = aabbs.buffer, .offset = 0u, .range = VK_WHOLE_SIZE};
+        const vk::DescriptorImageInfo prepass_info{.imageView = per_frame[i].prepass_texture.image_view, .imageLayout = vk::ImageLayout::eGeneral};
+        const vk::DescriptorBufferInfo statistics_info{.buffer = per_frame[i].raymarch_statistics.buffer, .offset = 0u, .range = VK_WHOLE_SIZE};
+        const vk::DescriptorBufferInfo cameras_info{.buffer = per_frame[i].cameras.buffer, .offset = 0u, .range = VK_WHOLE_SIZE};
+        const vk::DescriptorBufferInfo ambient_occlusion_info{.buffer = per_frame[i].tlas.ambient_occlusion_flags.buffer, .offset = 0u, .range = VK_WHOLE_SIZE};
 
         device.updateDescriptorSets(
             std::array{
@@ -221,6 +641,88 @@ void Renderer::create_descriptor_sets(vk::DescriptorPool descriptor_pool, size_t
                     .descriptorType = vk::DescriptorType::eStorageBuffer,
                     .pBufferInfo = &light_info
                 },
+                vk::WriteDescriptorSet{
+                    .dstSet = descriptor_sets[i],
+                    .dstBinding = 4,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType = vk::DescriptorType::eStorageBuffer,
+                    .pBufferInfo = &aabb_info
+                },
+                vk::WriteDescriptorSet{
+                    .dstSet = descriptor_sets[i],
+                    .dstBinding = 5,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType = vk::DescriptorType::eStorageBuffer,
+                    .pBufferInfo = &ambient_occlusion_info
+                },
+                vk::WriteDescriptorSet{
+                    .dstSet = descriptor_sets[i],
+                    .dstBinding = 6,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType = vk::DescriptorType::eStorageBuffer,
+                    .pBufferInfo = &statistics_info
+                },
+                vk::WriteDescriptorSet{
+                    .dstSet = descriptor_sets[i],
+                    .dstBinding = 7,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType = vk::DescriptorType::eStorageImage,
+                    .pImageInfo = &prepass_info
+                },
+                vk::WriteDescriptorSet{
+                    .dstSet = descriptor_sets[i],
+                    .dstBinding = 9,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType = vk::DescriptorType::eUniformBuffer,
+                    .pBufferInfo = &cameras_info
+                },
+            },
+            {}
+        );
+    }
+
+    for (size_t i = 0; i < command_pool_size; i++) {
+        if (!per_frame[i].depths.buffer) {
+            continue;
+        }
+        const vk::DescriptorBufferInfo depths_info{.buffer = per_frame[i].depths.buffer, .offset = 0u, .range = VK_WHOLE_SIZE};
+        device.updateDescriptorSets(
+            vk::WriteDescriptorSet{
+                .dstSet = descriptor_sets[i],
+                .dstBinding = 12,
+                .dstArrayElement = 0,
+                .descriptorCount = 1,
+                .descriptorType = vk::DescriptorType::eStorageBuffer,
+                .pBufferInfo = &depths_info
+            },
+            {}
+        );
+    }
+
+    if (distance_fields.empty()) {
+        return;
+    }
+    std::vector<vk::DescriptorImageInfo> distance_field_infos;
+    distance_field_infos.reserve(distance_fields.size());
+    for (const auto& distance_field : distance_fields) {
+        distance_field_infos.push_back(vk::DescriptorImageInfo{
+            .sampler = distance_field_sampler, .imageView = distance_field.image_view, .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal
+        });
+    }
+    for (size_t i = 0; i < command_pool_size; i++) {
+        device.updateDescriptorSets(
+            vk::WriteDescriptorSet{
+                .dstSet = descriptor_sets[i],
+                .dstBinding = 8,
+                .dstArrayElement = 0,
+                .descriptorCount = static_cast<uint32_t>(distance_field_infos.size()),
+                .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+                .pImageInfo = distance_field_infos.data()
             },
             {}
         );
@@ -16,7 +16,7 @@ public:
     Vma_image image;
     vk::ImageView image_view;
 
-    Storage_texture(Context& context, vk::Extent2D extent, vk::CommandBuffer command_buffer);
+    Storage_texture(Context& context, vk::Extent2D extent, vk::CommandBuffer command_buffer, vk::Format format = vk::Format::eR8G8B8A8Unorm);
     Storage_texture(const Storage_texture& other) = delete;
     Storage_texture(Storage_texture&& other) noexcept;
     Storage_texture& operator=(const Storage_texture& other) = delete;
@@ -31,8 +31,6 @@ module :private;
 
 namespace tale::vulkan {
 
-static constexpr vk::Format storage_format = vk::Format::eR8G8B8A8Unorm;
-
 Storage_texture::Storage_texture(Storage_texture&& other) noexcept:
     image(std::move(other.image)),
     image_view(other.image_view),
@@ -47,12 +45,12 @@ Storage_texture& Storage_texture::operator=(Storage_texture&& other) noexcept {
     return *this;
 }
 
-Storage_texture::Storage_texture(Context& context, vk::Extent2D extent, vk::CommandBuffer command_buffer):
+Storage_texture::Storage_texture(Context& context, vk::Extent2D extent, vk::CommandBuffer command_buffer, vk::Format format):
     image(
         context.device, context.allocator,
         vk::ImageCreateInfo{
             .imageType = vk::ImageType::e2D,
-            .format = storage_format,
+            .format = format,
             .extent = {extent.width, extent.height, 1},
             .mipLevels = 1u,
             .arrayLayers = 1u,
@@ -68,7 +66,7 @@ Storage_texture::Storage_texture(Context& context, vk::Extent2D extent, vk::Comm
     image_view = device.createImageView(vk::ImageViewCreateInfo{
         .image = image.image,
         .viewType = vk::ImageViewType::e2D,
-        .format = storage_format,
+        .format = format,
         .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor, .baseMipLevel = 0u, .levelCount = 1u, .baseArrayLayer = 0u, .layerCount = 1u}
     });
     command_buffer.pipelineBarrier(
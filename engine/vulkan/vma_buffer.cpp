@@ -5,6 +5,7 @@ module;
 #include <utility>
 #include <vma_includes.hpp>
 export module tale.vulkan.buffer;
+import std;
 import vulkan_hpp;
 
 namespace tale::vulkan {
@@ -23,7 +24,10 @@ public:
     ~Vma_buffer();
 
     void copy(const void* data, size_t size) { std::memcpy(mapped, data, size); }
+    void copy(const void* data, size_t size, size_t offset) { std::memcpy(static_cast<std::byte*>(mapped) + offset, data, size); }
     void flush() { vmaFlushAllocation(allocator, allocation, 0, VK_WHOLE_SIZE); }
+    void flush(vk::DeviceSize offset, vk::DeviceSize size) { vmaFlushAllocation(allocator, allocation, offset, size); }
+    void invalidate() { vmaInvalidateAllocation(allocator, allocation, 0, VK_WHOLE_SIZE); }
     void* map() {
         vmaMapMemory(allocator, allocation, &mapped);
         return mapped;
@@ -55,6 +59,40 @@ export struct Buffer_from_staged {
     Vma_buffer staging;
 };
 
+// Persistently mapped staging buffer, the space is given back once the upload timeline reaches the value of the batch that used it
+// Batches may be open at the same time, each span of the ring belongs to the batch that pushed it
+export class Staging_ring {
+public:
+    Vma_buffer staging{};
+
+    Staging_ring() = default;
+    Staging_ring(vk::Device device, VmaAllocator allocator, vk::DeviceSize size);
+    Staging_ring(const Staging_ring& other) = delete;
+    Staging_ring(Staging_ring&& other) noexcept = default;
+    Staging_ring& operator=(const Staging_ring& other) = delete;
+    Staging_ring& operator=(Staging_ring&& other) noexcept = default;
+    ~Staging_ring() = default;
+
+    // Return the offset of the data in the staging buffer, nothing if the ring is full
+    [[nodiscard]] std::optional<vk::DeviceSize> push(const void* batch, const void* data, vk::DeviceSize size, vk::DeviceSize alignment);
+    // Everything the batch pushed is in use until the timeline reaches this value
+    void close(const void* batch, uint64_t timeline_value);
+    void reclaim(uint64_t completed_timeline_value);
+
+private:
+    // In ring order, the timeline value stays 0 until the batch is closed
+    struct In_flight {
+        const void* batch;
+        uint64_t timeline_value;
+        vk::DeviceSize size;
+    };
+
+    vk::DeviceSize capacity = 0u;
+    vk::DeviceSize head = 0u;
+    vk::DeviceSize used = 0u;
+    std::deque<In_flight> in_flight;
+};
+
 }
 
 module :private;
@@ -115,4 +153,52 @@ Buffer_from_staged::Buffer_from_staged(
 
     command_buffer.copyBuffer(staging.buffer, result.buffer, vk::BufferCopy{.srcOffset = 0, .dstOffset = 0, .size = buffer_info.size});
 }
-}
\ No newline at end of file
+
+Staging_ring::Staging_ring(vk::Device device, VmaAllocator allocator, vk::DeviceSize size):
+    staging(
+        device, allocator, vk::BufferCreateInfo{.size = size, .usage = vk::BufferUsageFlagBits::eTransferSrc},
+        VmaAllocationCreateInfo{
+            .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, .usage = VMA_MEMORY_USAGE_AUTO
+        }
+    ),
+    capacity(size) {}
+
+std::optional<vk::DeviceSize> Staging_ring::push(const void* batch, const void* data, vk::DeviceSize size, vk::DeviceSize alignment) {
+    vk::DeviceSize offset = (head + alignment - 1) & ~(alignment - 1);
+    vk::DeviceSize padding = offset - head;
+    if (offset + size > capacity) {
+        // Wrap around, the end of the buffer is wasted until the batch is reclaimed
+        padding = capacity - head;
+        offset = 0u;
+    }
+    if (used + padding + size > capacity) {
+        return std::nullopt;
+    }
+    std::memcpy(static_cast<std::byte*>(staging.mapped) + offset, data, size);
+    staging.flush(offset, size);
+    head = offset + size;
+    used += padding + size;
+    in_flight.push_back(In_flight{.batch = batch, .timeline_value = 0u, .size = padding + size});
+    return offset;
+}
+
+void Staging_ring::close(const void* batch, uint64_t timeline_value) {
+    for (In_flight& span : in_flight) {
+        if (span.batch == batch && span.timeline_value == 0u) {
+            span.timeline_value = timeline_value;
+            span.batch = nullptr;
+        }
+    }
+}
+
+void Staging_ring::reclaim(uint64_t completed_timeline_value) {
+    // A span still open or pending blocks the ones after it, they are reused in ring order
+    while (!in_flight.empty() && in_flight.front().timeline_value != 0u && in_flight.front().timeline_value <= completed_timeline_value) {
+        used -= in_flight.front().size;
+        in_flight.pop_front();
+    }
+    if (used == 0u) {
+        head = 0u;
+    }
+}
+}